@@ -0,0 +1,1010 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * auth.c: runs the authentication backend (PAM or BSD Auth) in long-lived
+ *         helper processes, which are forked at startup and talk to i3lock
+ *         over a socketpair. Slow or misbehaving backends can therefore never
+ *         stall the X11 event handling, and PAM modules are only loaded once.
+ *
+ * The helpers are not forked by i3lock itself, but by the spawner, a process
+ * which auth_init() forks before i3lock starts any thread (see the raise
+ * watchers and the compose table in i3lock.c). After fork() in a process with
+ * threads, the child may only call async-signal-safe functions until it
+ * execs, because another thread may have held e.g. the malloc lock. The
+ * helper calls pam_start(), which loads modules and allocates. The spawner
+ * stays single-threaded: For every helper i3lock asks for, it forks one and
+ * passes i3lock’s end of the socketpair back (SCM_RIGHTS), along with the pid.
+ *
+ * With PAM, there is one helper per configured service (see --pam-service).
+ * Every password is verified by all of them concurrently, and the first one to
+ * accept it wins, so that e.g. a fast local stack does not have to wait for a
+ * slow network-backed one.
+ *
+ * Every message is a frame consisting of a 32-bit length (in host byte order)
+ * followed by that many bytes of payload. The first byte of the payload is the
+ * message type:
+ *
+ *   i3lock → helper:  AUTH_MSG_PASSWORD <password>
+ *   helper → i3lock:  AUTH_MSG_READY                       (after pam_start())
+ *                     AUTH_MSG_VERDICT  <0 or 1> <timestamps> [<message> '\0']…
+ *                     AUTH_MSG_SETCRED  <duration>           (after a success)
+ *
+ * The timestamps are the 64-bit monotonic times (see stats_now_us()) at which
+ * the helper reached the phases AUTH_PHASE_START to AUTH_PHASE_AUTHENTICATED.
+ *
+ * After a successful attempt, the helper sends its verdict right away and only
+ * then refreshes the credentials and ends the PAM transaction, so that slow
+ * modules (e.g. Kerberos) do not keep the screen locked. It reports how long
+ * pam_setcred() took in microseconds (64 bits), and prints it with --debug.
+ * Only with --daemon is i3lock still running to read that frame.
+ *
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <err.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef __OpenBSD__
+#include <bsd_auth.h>
+#else
+#include <security/pam_appl.h>
+#endif
+#ifdef I3LOCK_MOCK_AUTH
+#include "mock_auth.h"
+#endif
+#include <ev.h>
+
+#include "i3lock.h"
+#include "auth.h"
+#include "stats.h"
+#include "secmem.h"
+
+#define AUTH_MSG_READY 'r'
+#define AUTH_MSG_PASSWORD 'p'
+#define AUTH_MSG_VERDICT 'v'
+#define AUTH_MSG_SETCRED 's'
+
+/* The maximum payload size of a frame. */
+#define AUTH_MAX_FRAME 4096
+
+#define AUTH_PASSWORD_SIZE 512
+
+extern bool debug_mode;
+
+typedef enum {
+    HELPER_DEAD = 0, /* no helper process running */
+    HELPER_STARTING, /* forked, waiting for AUTH_MSG_READY */
+    HELPER_IDLE,     /* ready for the next password */
+    HELPER_BUSY,     /* verifying a password */
+    HELPER_SETCRED,  /* accepted the password, refreshing the credentials */
+} helper_state_t;
+
+typedef struct auth_helper {
+    /* The PAM service this helper authenticates against. */
+    const char *service;
+    helper_state_t state;
+    pid_t pid;
+    /* i3lock’s end of the socketpair. */
+    int fd;
+    struct ev_io watcher;
+    /* Whether the helper still owes a verdict for the attempt in flight, and
+     * whether that attempt was already re-sent after a crash. */
+    bool pending;
+    bool resent;
+    /* The number of times this helper was started. */
+    unsigned int spawns;
+    /* Time from handing out the password to this helper’s verdict. */
+    histogram_t *latency;
+    /* Frames are read without blocking and may arrive in pieces. */
+    char buf[sizeof(uint32_t) + AUTH_MAX_FRAME];
+    size_t len;
+} auth_helper_t;
+
+static auth_helper_t helpers[AUTH_MAX_SERVICES];
+static int num_helpers;
+
+static struct ev_loop *auth_loop;
+static auth_done_cb_t auth_done_cb;
+static char *auth_username;
+
+/* In i3lock, this holds the password of the attempt in flight until its
+ * verdict arrived, so that it can be re-sent when a helper crashed. In the
+ * helper, it holds the password which the backend asks for. Allocated from
+ * the secure arena. */
+static char *auth_password;
+static bool auth_pending;
+static uint64_t auth_started_us;
+
+/* The messages of all helpers which rejected the attempt in flight. */
+static auth_result_t auth_failure;
+static char auth_failure_messages[AUTH_MAX_FRAME];
+static size_t auth_failure_messages_len;
+
+#ifndef __OpenBSD__
+static pam_handle_t *pam_handle;
+#endif
+
+/* The phases whose timestamps the helper reports in AUTH_MSG_VERDICT. */
+#define HELPER_FIRST_PHASE AUTH_PHASE_START
+#define HELPER_NUM_PHASES (AUTH_PHASE_AUTHENTICATED - AUTH_PHASE_START + 1)
+#define VERDICT_HEADER_LEN (1 + HELPER_NUM_PHASES * sizeof(uint64_t))
+
+/* Timestamps and messages collected in the helper during one attempt. */
+static uint64_t helper_timestamps[HELPER_NUM_PHASES];
+static char helper_messages[AUTH_MAX_FRAME - 1 - VERDICT_HEADER_LEN];
+static size_t helper_messages_len;
+static int helper_num_messages;
+
+static void helper_mark(auth_phase_t phase) {
+    helper_timestamps[phase - HELPER_FIRST_PHASE] = stats_now_us();
+}
+
+static void clear_auth_password(void) {
+    secmem_clear(auth_password, AUTH_PASSWORD_SIZE);
+}
+
+/*
+ * Sends one frame. The socket is only ever written to when the peer is waiting
+ * for a frame, so a partial write means that the peer is gone.
+ *
+ * The payload is sent from where it is, so that the password is never copied
+ * out of the arena.
+ *
+ */
+static bool write_frame(int fd, char type, const char *payload, size_t len) {
+    uint32_t frame_len = len + 1;
+
+    if (frame_len > AUTH_MAX_FRAME)
+        return false;
+
+    struct iovec iov[] = {
+        {.iov_base = &frame_len, .iov_len = sizeof(frame_len)},
+        {.iov_base = &type, .iov_len = 1},
+        {.iov_base = (void *)payload, .iov_len = len},
+    };
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = sizeof(iov) / sizeof(iov[0])};
+
+    for (;;) {
+        /* Skip what has been sent already. */
+        while (msg.msg_iovlen > 0 && msg.msg_iov->iov_len == 0) {
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen == 0)
+            return true;
+
+        /* MSG_NOSIGNAL: A SIGPIPE must never terminate (and thereby unlock)
+         * i3lock just because the helper crashed. */
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        for (struct iovec *v = msg.msg_iov; n > 0; v++) {
+            size_t done = ((size_t)n < v->iov_len ? (size_t)n : v->iov_len);
+            v->iov_base = (char *)v->iov_base + done;
+            v->iov_len -= done;
+            n -= done;
+        }
+    }
+}
+
+/*******************************************************************************
+ * The helper process.
+ ******************************************************************************/
+
+static bool read_full(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if (n == 0)
+            return false;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+static void add_message(const char *msg) {
+    size_t len = strlen(msg) + 1;
+
+    if (helper_num_messages == AUTH_MAX_MESSAGES ||
+        helper_messages_len + len > sizeof(helper_messages))
+        return;
+
+    memcpy(helper_messages + helper_messages_len, msg, len);
+    helper_messages_len += len;
+    helper_num_messages++;
+}
+
+#ifndef __OpenBSD__
+/*
+ * Callback function for PAM. We answer password requests and collect
+ * informational and error messages to pass them on to i3lock.
+ *
+ */
+static int conv_callback(int num_msg, const struct pam_message **msg,
+                         struct pam_response **resp, void *appdata_ptr) {
+    if (num_msg == 0)
+        return 1;
+
+    /* PAM expects an array of responses, one for each message */
+    if ((*resp = calloc(num_msg, sizeof(struct pam_response))) == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    if (helper_timestamps[AUTH_PHASE_CONV - HELPER_FIRST_PHASE] == 0)
+        helper_mark(AUTH_PHASE_CONV);
+
+    for (int c = 0; c < num_msg; c++) {
+        if (msg[c]->msg_style == PAM_ERROR_MSG ||
+            msg[c]->msg_style == PAM_TEXT_INFO) {
+            add_message(msg[c]->msg);
+            continue;
+        }
+
+        if (msg[c]->msg_style != PAM_PROMPT_ECHO_OFF &&
+            msg[c]->msg_style != PAM_PROMPT_ECHO_ON)
+            continue;
+
+        /* return code is currently not used but should be set to zero */
+        (*resp)[c].resp_retcode = 0;
+        /* Ownership of the response passes to PAM, which releases it with
+         * free(3). It therefore has to live on the heap and is the only copy
+         * of the password outside of the arena. Modules overwrite it before
+         * freeing it (e.g. pam_unix via _pam_overwrite()). */
+        if (((*resp)[c].resp = strdup(auth_password)) == NULL) {
+            perror("strdup");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+static bool authenticate(void) {
+    helper_mark(AUTH_PHASE_START);
+#ifdef __OpenBSD__
+    if (auth_userokay(auth_username, NULL, NULL, auth_password) != 0) {
+        helper_mark(AUTH_PHASE_AUTHENTICATED);
+        DEBUG("successfully authenticated\n");
+        return true;
+    }
+    helper_mark(AUTH_PHASE_AUTHENTICATED);
+#else
+    int ret = pam_authenticate(pam_handle, 0);
+    helper_mark(AUTH_PHASE_AUTHENTICATED);
+    if (ret == PAM_SUCCESS) {
+        DEBUG("successfully authenticated\n");
+        return true;
+    }
+#endif
+    return false;
+}
+
+/*
+ * Main loop of the helper process: Verifies every password which i3lock sends
+ * against the given PAM service until one was correct or i3lock closed its end
+ * of the socketpair.
+ *
+ */
+static void helper_main(int fd, const char *service) {
+    /* The helper has no business with whatever i3lock had in the arena when
+     * it was forked. Memory locks are not inherited across fork(). */
+    secmem_wipe();
+    if (!secmem_lock())
+        _exit(EXIT_FAILURE);
+
+#ifndef __OpenBSD__
+    static struct pam_conv conv = {conv_callback, NULL};
+    int ret;
+
+    if ((ret = pam_start(service, auth_username, &conv, &pam_handle)) != PAM_SUCCESS)
+        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
+
+    if ((ret = pam_set_item(pam_handle, PAM_TTY, getenv("DISPLAY"))) != PAM_SUCCESS)
+        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
+#endif
+
+    if (!write_frame(fd, AUTH_MSG_READY, NULL, 0))
+        _exit(EXIT_FAILURE);
+
+    bool success = false;
+    while (!success) {
+        uint32_t len;
+        char type;
+
+        if (!read_full(fd, &len, sizeof(len)) ||
+            len == 0 || len > AUTH_PASSWORD_SIZE ||
+            !read_full(fd, &type, 1) ||
+            type != AUTH_MSG_PASSWORD ||
+            !read_full(fd, auth_password, len - 1))
+            break;
+        auth_password[len - 1] = '\0';
+
+        memset(helper_timestamps, 0, sizeof(helper_timestamps));
+        helper_messages_len = 0;
+        helper_num_messages = 0;
+        success = authenticate();
+        clear_auth_password();
+
+        char verdict[VERDICT_HEADER_LEN + sizeof(helper_messages)];
+        verdict[0] = success;
+        memcpy(verdict + 1, helper_timestamps, sizeof(helper_timestamps));
+        memcpy(verdict + VERDICT_HEADER_LEN, helper_messages, helper_messages_len);
+        if (!write_frame(fd, AUTH_MSG_VERDICT, verdict, VERDICT_HEADER_LEN + helper_messages_len))
+            break;
+    }
+
+#ifndef __OpenBSD__
+    if (success) {
+        /* i3lock is unlocking in the meantime, so it does not matter how long
+         * this takes.
+         *
+         * PAM credentials should be refreshed, this will for example update any kerberos tickets.
+         * Related to credentials pam_end() needs to be called to cleanup any temporary
+         * credentials like kerberos /tmp/krb5cc_pam_* files which may of been left behind if the
+         * refresh of the credentials failed. */
+        uint64_t start = stats_now_us();
+        pam_setcred(pam_handle, PAM_REFRESH_CRED);
+        uint64_t duration = stats_now_us() - start;
+        DEBUG("pam_setcred() took %.3f ms\n", duration / 1000.0);
+        write_frame(fd, AUTH_MSG_SETCRED, (const char *)&duration, sizeof(duration));
+        close(fd);
+        pam_end(pam_handle, PAM_SUCCESS);
+    }
+#endif
+    _exit(EXIT_SUCCESS);
+}
+
+/*******************************************************************************
+ * The spawner process.
+ ******************************************************************************/
+
+/*
+ * Closes all file descriptors starting with lowfd. The helper must neither
+ * keep the X11 connection nor a sleep lock fd (see XSS_SLEEP_LOCK_FD) open.
+ *
+ */
+static void close_fds_from(int lowfd) {
+#ifdef HAVE_CLOSEFROM
+    closefrom(lowfd);
+#else
+    long max = sysconf(_SC_OPEN_MAX);
+    if (max < 0)
+        max = 1024;
+    for (int fd = lowfd; fd < max; fd++)
+        close(fd);
+#endif
+}
+
+/* Sent by i3lock to the spawner for every helper it needs. The helper’s index
+ * selects the service, spawns seeds the mock backend. */
+typedef struct spawn_request {
+    int helper;
+    unsigned int spawns;
+} spawn_request_t;
+
+/* i3lock’s end of the socketpair to the spawner, -1 if it is gone. */
+static int spawner_fd = -1;
+
+/*
+ * Sends the pid of a new helper and i3lock’s end of its socketpair (unless the
+ * helper could not be started, i.e. pid is -1).
+ *
+ */
+static bool send_helper(int fd, pid_t pid, int helper_fd) {
+    struct iovec iov = {.iov_base = &pid, .iov_len = sizeof(pid)};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+
+    if (pid != -1) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &helper_fd, sizeof(int));
+    }
+
+    ssize_t n;
+    while ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+        ;
+    return (n == sizeof(pid));
+}
+
+/*
+ * Receives what send_helper() sent. Returns false if the spawner is gone,
+ * *pid is -1 if it could not start the helper.
+ *
+ */
+static bool receive_helper(int fd, pid_t *pid, int *helper_fd) {
+    struct iovec iov = {.iov_base = pid, .iov_len = sizeof(*pid)};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t n;
+    while ((n = recvmsg(fd, &msg, 0)) == -1 && errno == EINTR)
+        ;
+    if (n != sizeof(*pid))
+        return false;
+    if (*pid == -1)
+        return true;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+        return false;
+    memcpy(helper_fd, CMSG_DATA(cmsg), sizeof(int));
+    fcntl(*helper_fd, F_SETFD, FD_CLOEXEC);
+    return true;
+}
+
+/*
+ * Main loop of the spawner process: Forks a helper for every request until
+ * i3lock closes its end of the socketpair.
+ *
+ */
+static void spawner_main(int fd) {
+    /* Exited helpers are reaped automatically. The spawner shares the name of
+     * i3lock, so “pkill -USR1 i3lock” reaches it too. */
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
+
+    spawn_request_t req;
+    while (read_full(fd, &req, sizeof(req))) {
+        if (req.helper < 0 || req.helper >= num_helpers)
+            break;
+
+        int fds[2];
+        pid_t pid = -1;
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+            perror("socketpair");
+        } else if ((pid = fork()) == -1) {
+            perror("fork");
+        } else if (pid == 0) {
+            /* Child: PAM modules (e.g. pam_unix) wait for their own children.
+             * Keep only stdin, stdout, stderr and the socketpair (as fd 3),
+             * which also closes the spawner’s socket. */
+            signal(SIGCHLD, SIG_DFL);
+            close(fds[0]);
+            if (fds[1] != 3) {
+                dup2(fds[1], 3);
+                close(fds[1]);
+            }
+            close_fds_from(4);
+#ifdef I3LOCK_MOCK_AUTH
+            mock_auth_seed(req.helper, req.spawns);
+#endif
+            helper_main(3, helpers[req.helper].service);
+        }
+
+        if (pid != -1)
+            close(fds[1]);
+        bool sent = send_helper(fd, pid, fds[0]);
+        if (pid != -1)
+            close(fds[0]);
+        if (!sent)
+            break;
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+/*
+ * Forks the spawner. Has to be called before i3lock starts any thread.
+ *
+ */
+static bool spawner_start(void) {
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        perror("socketpair");
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        /* Child: The spawner must neither keep the X11 connection nor a sleep
+         * lock or inhibitor fd open, and has no business with the arena. */
+        close(fds[0]);
+        if (fds[1] != 3) {
+            dup2(fds[1], 3);
+            close(fds[1]);
+        }
+        close_fds_from(4);
+        secmem_wipe();
+        spawner_main(3);
+    }
+
+    close(fds[1]);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    spawner_fd = fds[0];
+    DEBUG("started the authentication helper spawner (pid %d)\n", pid);
+    return true;
+}
+
+/*******************************************************************************
+ * The i3lock side.
+ ******************************************************************************/
+
+static void helper_io_cb(EV_P_ ev_io *w, int revents);
+
+/*
+ * Asks the spawner for a new helper. This waits for the spawner, which only
+ * forks and therefore answers right away.
+ *
+ */
+static bool helper_spawn(auth_helper_t *h) {
+    spawn_request_t req = {.helper = h - helpers, .spawns = h->spawns};
+    pid_t pid;
+    int fd = -1;
+
+    if (spawner_fd == -1)
+        return false;
+
+    ssize_t n;
+    while ((n = send(spawner_fd, &req, sizeof(req), MSG_NOSIGNAL)) == -1 && errno == EINTR)
+        ;
+    if (n != sizeof(req) || !receive_helper(spawner_fd, &pid, &fd)) {
+        /* No helper can be started anymore: Forking here is not safe once
+         * threads run, see the top of this file. */
+        fprintf(stderr, "[i3lock] the authentication helper spawner is gone\n");
+        close(spawner_fd);
+        spawner_fd = -1;
+        return false;
+    }
+    if (pid == -1) {
+        DEBUG("could not start the authentication helper for \"%s\"\n", h->service);
+        return false;
+    }
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    DEBUG("started authentication helper for \"%s\" (pid %d)\n", h->service, pid);
+    h->spawns++;
+    h->state = HELPER_STARTING;
+    h->pid = pid;
+    h->fd = fd;
+    h->len = 0;
+
+    ev_io_init(&h->watcher, helper_io_cb, h->fd, EV_READ);
+    h->watcher.data = h;
+    ev_io_start(auth_loop, &h->watcher);
+    return true;
+}
+
+/*
+ * Closes our end of the socketpair. Exited helpers are reaped by the spawner,
+ * whose children they are.
+ *
+ */
+static void helper_close(auth_helper_t *h) {
+    ev_io_stop(auth_loop, &h->watcher);
+    close(h->fd);
+    h->fd = -1;
+    h->state = HELPER_DEAD;
+    secmem_clear(h->buf, sizeof(h->buf));
+    h->len = 0;
+}
+
+/*
+ * Kills a helper which is busy with a password which is no longer of interest,
+ * without waiting for it to exit.
+ *
+ */
+static void helper_kill(auth_helper_t *h) {
+    DEBUG("killing authentication helper for \"%s\" (pid %d)\n", h->service, h->pid);
+    kill(h->pid, SIGKILL);
+    helper_close(h);
+}
+
+static void finish_attempt(const auth_result_t *result) {
+    auth_pending = false;
+    clear_auth_password();
+    auth_done_cb(result);
+}
+
+/*
+ * Fails the attempt in flight once none of the helpers owes a verdict anymore.
+ *
+ */
+static void maybe_fail_attempt(void) {
+    if (!auth_pending)
+        return;
+
+    for (int i = 0; i < num_helpers; i++) {
+        if (helpers[i].pending)
+            return;
+    }
+
+    finish_attempt(&auth_failure);
+}
+
+static void add_failure_message(const char *msg) {
+    size_t len = strlen(msg) + 1;
+
+    if (auth_failure.num_messages == AUTH_MAX_MESSAGES ||
+        auth_failure_messages_len + len > sizeof(auth_failure_messages))
+        return;
+
+    char *copy = auth_failure_messages + auth_failure_messages_len;
+    memcpy(copy, msg, len);
+    auth_failure_messages_len += len;
+    auth_failure.messages[auth_failure.num_messages++] = copy;
+}
+
+/*
+ * Called when a helper cannot deliver a verdict for the attempt in flight.
+ *
+ */
+static void helper_give_up(auth_helper_t *h) {
+    h->pending = false;
+    h->resent = false;
+    maybe_fail_attempt();
+}
+
+static void helper_send_password(auth_helper_t *h) {
+    h->state = HELPER_BUSY;
+    if (!write_frame(h->fd, AUTH_MSG_PASSWORD, auth_password, strlen(auth_password))) {
+        /* The helper is in a bad state, so we kill it. The resulting EOF will
+         * restart it and re-send the password. */
+        DEBUG("could not send the password to the authentication helper\n");
+        kill(h->pid, SIGKILL);
+    }
+}
+
+/*
+ * Called when a helper closed its end of the socketpair, most likely because
+ * it crashed in a PAM module. A new helper is started right away, and an
+ * attempt which was in flight is re-sent once.
+ *
+ */
+static void helper_died(auth_helper_t *h) {
+    helper_state_t state = h->state;
+
+    DEBUG("authentication helper for \"%s\" (pid %d) exited\n", h->service, h->pid);
+    helper_close(h);
+
+    /* If the helper did not even get ready, a new one would most likely fail
+     * the same way. The next attempt will try again. */
+    if (state == HELPER_STARTING || !helper_spawn(h)) {
+        if (h->pending)
+            helper_give_up(h);
+        return;
+    }
+
+    if (state == HELPER_BUSY && h->pending) {
+        if (h->resent) {
+            helper_give_up(h);
+        } else {
+            /* The password is sent once the new helper is ready. */
+            h->resent = true;
+        }
+    }
+}
+
+static void handle_verdict(auth_helper_t *h, const char *payload, size_t len) {
+    bool success = (payload[1] != 0);
+
+    h->state = HELPER_IDLE;
+    h->pending = false;
+    h->resent = false;
+    histogram_add(h->latency, stats_now_us() - auth_started_us);
+    DEBUG("\"%s\" %s the password\n", h->service, success ? "accepted" : "rejected");
+
+    bool decisive = success;
+    if (!success) {
+        decisive = true;
+        for (int i = 0; i < num_helpers; i++)
+            decisive &= !helpers[i].pending;
+    }
+
+    /* The phases are those of the helper which decided the attempt. */
+    if (decisive) {
+        stats_auth_mark(AUTH_PHASE_VERDICT);
+        for (int i = 0; i < HELPER_NUM_PHASES; i++) {
+            uint64_t ts;
+            memcpy(&ts, payload + 2 + i * sizeof(ts), sizeof(ts));
+            if (ts != 0)
+                stats_auth_set(HELPER_FIRST_PHASE + i, ts);
+        }
+    }
+
+    auth_result_t result = {.success = true};
+    const char *msg = payload + 1 + VERDICT_HEADER_LEN;
+    const char *end = payload + len;
+    while (msg < end) {
+        const char *nul = memchr(msg, '\0', end - msg);
+        if (nul == NULL)
+            break;
+        if (!success)
+            add_failure_message(msg);
+        else if (result.num_messages < AUTH_MAX_MESSAGES)
+            result.messages[result.num_messages++] = msg;
+        msg = nul + 1;
+    }
+
+    if (!success) {
+        maybe_fail_attempt();
+        return;
+    }
+
+    /* First success wins: The other helpers are not needed anymore. */
+    for (int i = 0; i < num_helpers; i++) {
+        auth_helper_t *other = &helpers[i];
+        if (other == h || !other->pending)
+            continue;
+        other->pending = false;
+        if (other->state == HELPER_BUSY)
+            helper_kill(other);
+    }
+
+    finish_attempt(&result);
+
+    /* The helper exits after refreshing the credentials. */
+#ifdef __OpenBSD__
+    helper_close(h);
+#else
+    h->state = HELPER_SETCRED;
+#endif
+}
+
+static void handle_frame(auth_helper_t *h, const char *payload, size_t len) {
+    switch (payload[0]) {
+        case AUTH_MSG_READY:
+            if (h->state != HELPER_STARTING)
+                break;
+            h->state = HELPER_IDLE;
+            if (h->pending)
+                helper_send_password(h);
+            return;
+
+        case AUTH_MSG_VERDICT:
+            if (h->state != HELPER_BUSY || len < 1 + VERDICT_HEADER_LEN)
+                break;
+            handle_verdict(h, payload, len);
+            return;
+
+        case AUTH_MSG_SETCRED:
+            if (h->state != HELPER_SETCRED || len != 1 + sizeof(uint64_t))
+                break;
+            uint64_t duration;
+            memcpy(&duration, payload + 1, sizeof(duration));
+            stats_auth_setcred(duration);
+            return;
+    }
+
+    DEBUG("unexpected message 0x%02x from the authentication helper\n", payload[0]);
+    kill(h->pid, SIGKILL);
+}
+
+static void helper_io_cb(EV_P_ ev_io *w, int revents) {
+    auth_helper_t *h = w->data;
+
+    ssize_t n = read(h->fd, h->buf + h->len, sizeof(h->buf) - h->len);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        helper_died(h);
+        return;
+    }
+    h->len += n;
+
+    while (h->fd != -1 && h->len >= sizeof(uint32_t)) {
+        uint32_t len;
+        memcpy(&len, h->buf, sizeof(len));
+        if (len == 0 || len > AUTH_MAX_FRAME) {
+            DEBUG("invalid frame length %u from the authentication helper\n", len);
+            kill(h->pid, SIGKILL);
+            helper_died(h);
+            return;
+        }
+        if (h->len < sizeof(len) + len)
+            break;
+
+        handle_frame(h, h->buf + sizeof(len), len);
+
+        if (h->fd == -1)
+            break;
+        h->len -= sizeof(len) + len;
+        memmove(h->buf, h->buf + sizeof(len) + len, h->len);
+    }
+}
+
+/*
+ * Starts one authentication helper for the given user per PAM service (only
+ * the first service is used with BSD Auth). cb will be called on the event
+ * loop for every finished attempt.
+ *
+ * Waits until all helpers initialized the backend, so that e.g. a broken PAM
+ * configuration still makes i3lock fail to start. Has to be called before any
+ * thread is started, because it forks the spawner.
+ *
+ */
+bool auth_init(struct ev_loop *loop, const char *username,
+               const char *const *services, int num_services, auth_done_cb_t cb) {
+    auth_loop = loop;
+    auth_done_cb = cb;
+
+    if ((auth_username = strdup(username)) == NULL)
+        return false;
+
+    if ((auth_password = secmem_alloc(AUTH_PASSWORD_SIZE)) == NULL)
+        return false;
+
+#ifdef __OpenBSD__
+    num_services = 1;
+#endif
+    if (num_services < 1 || num_services > AUTH_MAX_SERVICES)
+        return false;
+
+    for (int i = 0; i < num_services; i++) {
+        auth_helper_t *h = &helpers[num_helpers++];
+        h->service = services[i];
+        h->fd = -1;
+        h->latency = stats_auth_service(h->service);
+    }
+
+    if (!spawner_start())
+        return false;
+    for (int i = 0; i < num_helpers; i++) {
+        if (!helper_spawn(&helpers[i]))
+            return false;
+    }
+
+    for (int i = 0; i < num_helpers; i++) {
+        auth_helper_t *h = &helpers[i];
+        while (h->state == HELPER_STARTING) {
+            struct pollfd pfd = {.fd = h->fd, .events = POLLIN};
+            if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+                return false;
+            helper_io_cb(loop, &h->watcher, EV_READ);
+        }
+        if (h->state != HELPER_IDLE)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Hands the password over to all helpers and returns immediately. The result
+ * is delivered to the callback given to auth_init().
+ *
+ * Returns false if an attempt is already in progress or no helper could be
+ * started.
+ *
+ */
+bool auth_start(const char *password) {
+    if (auth_pending)
+        return false;
+
+    strncpy(auth_password, password, AUTH_PASSWORD_SIZE - 1);
+    auth_pending = true;
+    auth_started_us = stats_now_us();
+    memset(&auth_failure, 0, sizeof(auth_failure));
+    auth_failure_messages_len = 0;
+
+    bool started = false;
+    for (int i = 0; i < num_helpers; i++) {
+        auth_helper_t *h = &helpers[i];
+        if (h->state == HELPER_DEAD && !helper_spawn(h))
+            continue;
+
+        h->pending = true;
+        h->resent = false;
+        started = true;
+        if (h->state == HELPER_IDLE)
+            helper_send_password(h);
+    }
+
+    if (!started) {
+        auth_pending = false;
+        clear_auth_password();
+    }
+    return started;
+}
+
+/*
+ * Starts the helpers which are not running (e.g. the one which accepted the
+ * last password), so that the next attempt does not wait for them.
+ *
+ */
+void auth_prepare(void) {
+    for (int i = 0; i < num_helpers; i++) {
+        if (helpers[i].state == HELPER_DEAD)
+            (void)helper_spawn(&helpers[i]);
+    }
+}
+
+bool auth_in_progress(void) {
+    return auth_pending;
+}
+
+/*
+ * Abandons the attempt in flight without calling the callback. Helpers which
+ * are busy with it (possibly stuck in a PAM module) are killed and reaped in
+ * the background, and fresh ones are started right away.
+ *
+ */
+void auth_cancel(void) {
+    if (!auth_pending)
+        return;
+
+    auth_pending = false;
+    clear_auth_password();
+
+    for (int i = 0; i < num_helpers; i++) {
+        auth_helper_t *h = &helpers[i];
+        if (!h->pending)
+            continue;
+        h->pending = false;
+        h->resent = false;
+
+        /* A helper which is still starting did not get the password yet. */
+        if (h->state != HELPER_BUSY)
+            continue;
+
+        helper_kill(h);
+        helper_spawn(h);
+    }
+}
+
+/*
+ * Closes the connections to the helpers, which makes them exit. After a
+ * successful attempt, the winning helper already cleaned up (pam_end() for
+ * PAM) by itself.
+ *
+ */
+void auth_cleanup(void) {
+    for (int i = 0; i < num_helpers; i++) {
+        if (helpers[i].fd != -1)
+            helper_close(&helpers[i]);
+    }
+    if (spawner_fd != -1) {
+        close(spawner_fd);
+        spawner_fd = -1;
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef _AUTH_H
+#define _AUTH_H
+
+#include <stdbool.h>
+#include <ev.h>
+
+/* The maximum number of backend messages passed on per attempt. */
+#define AUTH_MAX_MESSAGES 8
+
+/* The maximum number of PAM services which are tried concurrently. */
+#define AUTH_MAX_SERVICES 8
+
+typedef struct auth_result {
+    bool success;
+    /* Informational and error messages the backend sent during the attempt
+     * (e.g. “Your password will expire in 3 days”). Only valid during the
+     * callback. */
+    int num_messages;
+    const char *messages[AUTH_MAX_MESSAGES];
+} auth_result_t;
+
+/* Called on the event loop once an authentication attempt finished. */
+typedef void (*auth_done_cb_t)(const auth_result_t *result);
+
+bool auth_init(struct ev_loop *loop, const char *username,
+               const char *const *services, int num_services, auth_done_cb_t cb);
+bool auth_start(const char *password);
+void auth_prepare(void);
+bool auth_in_progress(void);
+void auth_cancel(void);
+void auth_cleanup(void);
+
+#endif
@@ -0,0 +1,514 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * i3lock-bench.c: measures how long i3lock takes to lock the screen. It runs
+ *                 the given command (usually “i3lock -n …”) over and over on
+ *                 the X server in $DISPLAY and watches it as a separate client:
+ *
+ *   map    the time from starting the command until its window is mapped
+ *   lock   the time until the window is mapped and the keyboard is grabbed,
+ *          i.e. until the screen is actually locked
+ *   unlock with --unlock, the time from pressing Enter after the password
+ *          until the window is unmapped, i.e. until the desktop is visible
+ *   rss    with --memory, the resident memory (in kB) of the command and all
+ *   pss    its descendants once locked. Pages which forked processes share
+ *          count for each of them in rss, but only once in pss (the sum of
+ *          each page’s size divided by the number of processes mapping it).
+ *
+ * The keyboard grab is detected by the FocusIn event (with mode NotifyGrab)
+ * which the X server sends to the root window, so the observer does not
+ * interfere with i3lock’s own grab attempts. Only if that event is missing
+ * does it fall back to probing with a grab of its own.
+ *
+ * Once locked, the command is killed (or, with --unlock, the password is typed
+ * using XTEST and the command exits by itself) and the next run starts as soon
+ * as the X server has destroyed the window. The result is printed as one JSON object
+ * with percentiles (in milliseconds), see bench/run.sh.
+ *
+ * With --png, it instead writes a test image of the given size and exits.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <xcb/xcb.h>
+#include <cairo.h>
+
+#include "xtest.h"
+
+/* Give up on a run after this many milliseconds. */
+#define RUN_TIMEOUT 10000
+
+/* Start probing the grab when no FocusIn event arrived this long (in
+ * milliseconds) after the window was mapped. */
+#define PROBE_AFTER 250
+
+/* With --memory, wait this many milliseconds after locking before measuring,
+ * so that what i3lock starts after the first frame is running. */
+#define MEMORY_SETTLE 200
+
+typedef struct run {
+    double map;
+    double lock;
+    double unlock;
+    double rss;
+    double pss;
+} run_t;
+
+static xcb_connection_t *conn;
+static xcb_window_t root;
+
+/* The password to unlock with, or NULL to kill the command instead. */
+static const char *unlock_password;
+
+/* Whether to measure the memory use, see --memory. */
+static bool measure_memory;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void json_string(const char *s) {
+    putchar('"');
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+/*
+ * Writes a gradient of the given size, which does not compress well, so that
+ * decoding it takes about as long as decoding a photo.
+ *
+ */
+static int write_png(const char *path, int width, int height) {
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+    cairo_t *cr = cairo_create(surface);
+    cairo_pattern_t *pattern = cairo_pattern_create_linear(0, 0, width, height);
+    cairo_pattern_add_color_stop_rgb(pattern, 0, 0.18, 0.20, 0.25);
+    cairo_pattern_add_color_stop_rgb(pattern, 1, 0.53, 0.75, 0.82);
+    cairo_set_source(cr, pattern);
+    cairo_paint(cr);
+    cairo_pattern_destroy(pattern);
+
+    /* Add some noise, a smooth gradient would be too easy on zlib. */
+    cairo_surface_flush(surface);
+    unsigned char *data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    uint32_t seed = 1;
+    for (int y = 0; y < height; y++) {
+        uint32_t *row = (uint32_t *)(data + y * stride);
+        for (int x = 0; x < width; x++) {
+            seed = seed * 1103515245 + 12345;
+            row[x] ^= (seed >> 16) & 0x070707;
+        }
+    }
+    cairo_surface_mark_dirty(surface);
+
+    cairo_status_t status = cairo_surface_write_to_png(surface, path);
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+    if (status != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr, "i3lock-bench: could not write %s: %s\n", path, cairo_status_to_string(status));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Returns true if another client holds the keyboard grab. Our own grab is
+ * released in the same batch of requests, so it is held for as short as
+ * possible.
+ *
+ */
+static bool probe_grab(void) {
+    xcb_grab_keyboard_cookie_t cookie = xcb_grab_keyboard(
+        conn, false, root, XCB_CURRENT_TIME, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+    xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
+    xcb_grab_keyboard_reply_t *reply = xcb_grab_keyboard_reply(conn, cookie, NULL);
+    bool grabbed = (reply != NULL && reply->status != XCB_GRAB_STATUS_SUCCESS);
+    free(reply);
+    return grabbed;
+}
+
+/*
+ * Waits for events for at most timeout milliseconds. Returns false if the
+ * connection to the X server broke.
+ *
+ */
+static bool wait_for_event(double timeout) {
+    struct pollfd pfd = {.fd = xcb_get_file_descriptor(conn), .events = POLLIN};
+    if (timeout < 0)
+        timeout = 0;
+    if (poll(&pfd, 1, (int)timeout + 1) == -1 && errno != EINTR)
+        return false;
+    return !xcb_connection_has_error(conn);
+}
+
+/*
+ * Types the password and presses Enter. Returns the time (in milliseconds)
+ * until the given window was unmapped, or -1. Sets *destroyed if the window
+ * was destroyed meanwhile.
+ *
+ */
+static double unlock_screen(xcb_window_t window, bool *destroyed) {
+    xcb_generic_event_t *event;
+
+    if (!xtest_type(unlock_password))
+        return -1;
+    /* Only Enter should be in flight while measuring. */
+    free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), NULL));
+
+    double start = now_ms();
+    if (!xtest_key(XTEST_KEYSYM_RETURN))
+        return -1;
+    xcb_flush(conn);
+
+    double unmapped = -1;
+    while (unmapped < 0 && now_ms() - start < RUN_TIMEOUT && wait_for_event(RUN_TIMEOUT - (now_ms() - start))) {
+        while ((event = xcb_poll_for_event(conn)) != NULL) {
+            int type = event->response_type & 0x7f;
+            if (type == XCB_UNMAP_NOTIFY && ((xcb_unmap_notify_event_t *)event)->window == window && unmapped < 0)
+                unmapped = now_ms() - start;
+            if (type == XCB_DESTROY_NOTIFY && ((xcb_destroy_notify_event_t *)event)->window == window)
+                *destroyed = true;
+            free(event);
+        }
+    }
+    return unmapped;
+}
+
+/*
+ * Returns the parent of the given process, or -1 if it does not exist.
+ *
+ */
+static pid_t parent_of(pid_t pid) {
+    char path[64], line[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    bool ok = (fgets(line, sizeof(line), f) != NULL);
+    fclose(f);
+
+    /* The command name is in parentheses and may contain anything. */
+    char *end = (ok ? strrchr(line, ')') : NULL);
+    int ppid;
+    if (end == NULL || sscanf(end + 1, " %*c %d", &ppid) != 1)
+        return -1;
+    return ppid;
+}
+
+/*
+ * Adds the Rss and Pss (in kB) of the given process and all its descendants
+ * to the given totals. Threads are part of their process already.
+ *
+ */
+static void add_memory(pid_t pid, double *rss, double *pss) {
+    char path[64], line[256];
+    long value;
+
+    snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "Rss: %ld kB", &value) == 1)
+            *rss += value;
+        else if (sscanf(line, "Pss: %ld kB", &value) == 1)
+            *pss += value;
+    }
+    fclose(f);
+
+    DIR *proc = opendir("/proc");
+    if (proc == NULL)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(proc)) != NULL) {
+        pid_t child = atoi(entry->d_name);
+        if (child > 0 && parent_of(child) == pid)
+            add_memory(child, rss, pss);
+    }
+    closedir(proc);
+}
+
+/*
+ * Runs the command once. Returns false if it did not lock (or, with --unlock,
+ * unlock) the screen.
+ *
+ */
+static bool run_once(char **command, run_t *result) {
+    xcb_window_t window = XCB_NONE;
+    bool grabbed = false, destroyed = false, exited = false;
+    int status;
+
+    /* Discard what is left over from the previous run. */
+    free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), NULL));
+    xcb_generic_event_t *event;
+    while ((event = xcb_poll_for_event(conn)) != NULL)
+        free(event);
+
+    double start = now_ms();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return false;
+    }
+    if (pid == 0) {
+        execvp(command[0], command);
+        perror(command[0]);
+        _exit(127);
+    }
+
+    result->map = result->lock = result->unlock = -1;
+    result->rss = result->pss = 0;
+    while (result->lock < 0 && now_ms() - start < RUN_TIMEOUT) {
+        if (!exited && waitpid(pid, &status, WNOHANG) == pid) {
+            exited = true;
+            fprintf(stderr, "i3lock-bench: %s exited before locking\n", command[0]);
+            break;
+        }
+
+        if (window != XCB_NONE && !grabbed && now_ms() - result->map > PROBE_AFTER)
+            grabbed = probe_grab();
+
+        while ((event = xcb_poll_for_event(conn)) != NULL) {
+            switch (event->response_type & 0x7f) {
+                case XCB_MAP_NOTIFY:
+                    if (window == XCB_NONE) {
+                        window = ((xcb_map_notify_event_t *)event)->window;
+                        result->map = now_ms() - start;
+                    }
+                    break;
+                case XCB_FOCUS_IN:
+                    if (((xcb_focus_in_event_t *)event)->mode == XCB_NOTIFY_MODE_GRAB)
+                        grabbed = true;
+                    break;
+            }
+            free(event);
+        }
+
+        if (window != XCB_NONE && grabbed)
+            result->lock = now_ms() - start;
+        else if (!wait_for_event(window == XCB_NONE ? RUN_TIMEOUT : PROBE_AFTER / 10.0))
+            break;
+    }
+
+    if (result->lock >= 0 && measure_memory) {
+        usleep(MEMORY_SETTLE * 1000);
+        add_memory(pid, &result->rss, &result->pss);
+    }
+
+    if (result->lock >= 0 && unlock_password != NULL) {
+        result->unlock = unlock_screen(window, &destroyed);
+        /* Give the command some time to exit by itself. */
+        double deadline = now_ms() + RUN_TIMEOUT;
+        while (!exited && result->unlock >= 0 && now_ms() < deadline) {
+            if (waitpid(pid, &status, WNOHANG) == pid)
+                exited = true;
+            else
+                usleep(1000);
+        }
+    }
+
+    if (!exited) {
+        kill(pid, SIGTERM);
+        waitpid(pid, &status, 0);
+    }
+
+    /* Wait until the X server cleaned up after the command, so that the next
+     * run does not race against it. */
+    double deadline = now_ms() + RUN_TIMEOUT;
+    while (window != XCB_NONE && !destroyed && now_ms() < deadline && wait_for_event(deadline - now_ms())) {
+        while ((event = xcb_poll_for_event(conn)) != NULL) {
+            if ((event->response_type & 0x7f) == XCB_DESTROY_NOTIFY &&
+                ((xcb_destroy_notify_event_t *)event)->window == window)
+                destroyed = true;
+            free(event);
+        }
+    }
+    while (now_ms() < deadline && probe_grab())
+        usleep(1000);
+
+    return (result->lock >= 0 && (unlock_password == NULL || result->unlock >= 0));
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Prints min, max, mean and the 50th, 90th, 95th and 99th percentile (linear
+ * interpolation between the closest ranks) of the given values.
+ *
+ */
+static void print_stats(const char *name, double *values, int n) {
+    static const int percentiles[] = {50, 90, 95, 99};
+    double sum = 0;
+
+    qsort(values, n, sizeof(double), compare_doubles);
+    for (int i = 0; i < n; i++)
+        sum += values[i];
+
+    printf(", \"%s\": {\"min\": %.3f, \"max\": %.3f, \"mean\": %.3f", name, values[0], values[n - 1], sum / n);
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        double rank = (n - 1) * percentiles[i] / 100.0;
+        int lower = (int)rank;
+        int upper = (lower + 1 < n ? lower + 1 : lower);
+        printf(", \"p%d\": %.3f", percentiles[i],
+               values[lower] + (values[upper] - values[lower]) * (rank - lower));
+    }
+    printf("}");
+}
+
+static void usage(void) {
+    fprintf(stderr, "Syntax: i3lock-bench [-r runs] [-w warmup runs] [-l label] [-u password] [-m] -- command [args...]\n"
+                    "        i3lock-bench --png=<file> --size=<width>x<height>\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int runs = 50, warmup = 2;
+    const char *label = "", *png = NULL;
+    int width = 0, height = 0;
+    int o;
+    struct option longopts[] = {
+        {"runs", required_argument, NULL, 'r'},
+        {"warmup", required_argument, NULL, 'w'},
+        {"label", required_argument, NULL, 'l'},
+        {"unlock", required_argument, NULL, 'u'},
+        {"memory", no_argument, NULL, 'm'},
+        {"png", required_argument, NULL, 'p'},
+        {"size", required_argument, NULL, 's'},
+        {NULL, no_argument, NULL, 0}};
+
+    while ((o = getopt_long(argc, argv, "+r:w:l:u:m", longopts, NULL)) != -1) {
+        switch (o) {
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            case 'w':
+                warmup = atoi(optarg);
+                break;
+            case 'l':
+                label = optarg;
+                break;
+            case 'u':
+                unlock_password = optarg;
+                break;
+            case 'm':
+                measure_memory = true;
+                break;
+            case 'p':
+                png = optarg;
+                break;
+            case 's':
+                if (sscanf(optarg, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+                    usage();
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if (png != NULL) {
+        if (width == 0)
+            usage();
+        return write_png(png, width, height);
+    }
+    if (optind >= argc || runs < 1 || warmup < 0)
+        usage();
+    char **command = argv + optind;
+
+    int screen_number;
+    conn = xcb_connect(NULL, &screen_number);
+    if (xcb_connection_has_error(conn)) {
+        fprintf(stderr, "i3lock-bench: could not connect to the X server\n");
+        return EXIT_FAILURE;
+    }
+    xcb_screen_iterator_t iter = xcb_setup_roots_iterator(xcb_get_setup(conn));
+    for (int i = 0; i < screen_number; i++)
+        xcb_screen_next(&iter);
+    root = iter.data->root;
+
+    uint32_t mask = XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY | XCB_EVENT_MASK_FOCUS_CHANGE;
+    xcb_generic_error_t *error = xcb_request_check(
+        conn, xcb_change_window_attributes_checked(conn, root, XCB_CW_EVENT_MASK, &mask));
+    if (error != NULL) {
+        fprintf(stderr, "i3lock-bench: could not select events on the root window\n");
+        return EXIT_FAILURE;
+    }
+    if (unlock_password != NULL && !xtest_init(conn, root))
+        return EXIT_FAILURE;
+
+    double *map = calloc(runs, sizeof(double));
+    double *lock = calloc(runs, sizeof(double));
+    double *unlocked = calloc(runs, sizeof(double));
+    double *rss = calloc(runs, sizeof(double));
+    double *pss = calloc(runs, sizeof(double));
+    int done = 0, failures = 0;
+    if (map == NULL || lock == NULL || unlocked == NULL || rss == NULL || pss == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < warmup + runs; i++) {
+        run_t result;
+        if (!run_once(command, &result)) {
+            failures++;
+            continue;
+        }
+        if (i < warmup)
+            continue;
+        map[done] = result.map;
+        lock[done] = result.lock;
+        unlocked[done] = result.unlock;
+        rss[done] = result.rss;
+        pss[done] = result.pss;
+        done++;
+    }
+
+    printf("{\"label\": ");
+    json_string(label);
+    printf(", \"command\": [");
+    for (int i = 0; command[i] != NULL; i++) {
+        printf(i == 0 ? "" : ", ");
+        json_string(command[i]);
+    }
+    printf("], \"runs\": %d, \"failures\": %d", done, failures);
+    if (done > 0) {
+        print_stats("map_ms", map, done);
+        print_stats("lock_ms", lock, done);
+        if (unlock_password != NULL)
+            print_stats("unlock_ms", unlocked, done);
+        if (measure_memory) {
+            print_stats("rss_kb", rss, done);
+            print_stats("pss_kb", pss, done);
+        }
+    }
+    printf("}\n");
+
+    xcb_disconnect(conn);
+    return (done > 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,420 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * i3lock-stress.c: types passwords into i3lock as fast as a barcode scanner
+ *                  (by default 1000 keys per second) using XTEST, and checks
+ *                  that no key press gets lost. It runs the given command
+ *                  (usually “i3lock -n --debug”, built with
+ *                  --enable-mock-auth) over and over on the X server in
+ *                  $DISPLAY with a random password of its own in
+ *                  I3LOCK_MOCK_PASSWORD, types that password and presses
+ *                  Enter. The screen only unlocks if every key arrived, in
+ *                  order.
+ *
+ * Keys are sent in batches, one every BATCH_INTERVAL milliseconds. The
+ * command’s stderr is read to count the frames it drew (the “redraw_screen”
+ * lines of --debug), so that the result shows how well i3lock coalesces
+ * redraws: ideally, there is at most one frame per batch.
+ *
+ * The result is printed as one JSON object.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <xcb/xcb.h>
+
+#include "xtest.h"
+
+/* Give up on a run after this many milliseconds. */
+#define RUN_TIMEOUT 10000
+
+/* Probe the keyboard grab when no FocusIn event arrived this long (in
+ * milliseconds) after the window was mapped, see i3lock-bench.c. */
+#define PROBE_AFTER 250
+
+/* The time between two batches of keys, in milliseconds. */
+#define BATCH_INTERVAL 10
+
+/* i3lock ignores keys beyond this many bytes of password. */
+#define MAX_PASSWORD_LEN 500
+
+typedef enum {
+    RUN_UNLOCKED = 0, /* all keys arrived */
+    RUN_DROPPED,      /* the password was rejected, keys got lost */
+    RUN_FAILED,       /* the command did not lock or unlock in time */
+} run_status_t;
+
+typedef struct run {
+    run_status_t status;
+    int batches;
+    int redraws;
+} run_t;
+
+static xcb_connection_t *conn;
+static xcb_window_t root;
+
+/* The command’s stderr, and the part of a line which was read so far. */
+static int log_fd = -1;
+static char log_line[1024];
+static size_t log_len;
+static int log_redraws;
+static bool log_rejected;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void handle_log_line(const char *line) {
+    if (strstr(line, "redraw_screen(") != NULL)
+        log_redraws++;
+    else if (strstr(line, "Authentication failure") != NULL)
+        log_rejected = true;
+}
+
+/*
+ * Reads what the command wrote to stderr. It has to be read continuously,
+ * i3lock would block once the pipe is full.
+ *
+ */
+static void read_log(void) {
+    ssize_t n = -1;
+
+    while (log_fd != -1 &&
+           (n = read(log_fd, log_line + log_len, sizeof(log_line) - 1 - log_len)) != 0) {
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                close(log_fd);
+                log_fd = -1;
+            }
+            return;
+        }
+        log_len += n;
+        log_line[log_len] = '\0';
+
+        char *start = log_line, *newline;
+        while ((newline = strchr(start, '\n')) != NULL) {
+            *newline = '\0';
+            handle_log_line(start);
+            start = newline + 1;
+        }
+        log_len -= start - log_line;
+        memmove(log_line, start, log_len);
+        /* Lines which do not fit are cut. */
+        if (log_len == sizeof(log_line) - 1)
+            log_len = 0;
+    }
+    if (log_fd != -1 && n == 0) {
+        close(log_fd);
+        log_fd = -1;
+    }
+}
+
+/*
+ * Waits for X events or output of the command for at most timeout
+ * milliseconds. Returns false if the connection to the X server broke.
+ *
+ */
+static bool wait_for_event(double timeout) {
+    struct pollfd pfds[] = {
+        {.fd = xcb_get_file_descriptor(conn), .events = POLLIN},
+        {.fd = log_fd, .events = POLLIN},
+    };
+    if (timeout < 0)
+        timeout = 0;
+    if (poll(pfds, (log_fd == -1 ? 1 : 2), (int)timeout + 1) == -1 && errno != EINTR)
+        return false;
+    read_log();
+    return !xcb_connection_has_error(conn);
+}
+
+static bool keyboard_grabbed(void) {
+    xcb_grab_keyboard_cookie_t cookie = xcb_grab_keyboard(
+        conn, false, root, XCB_CURRENT_TIME, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+    xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
+    xcb_grab_keyboard_reply_t *reply = xcb_grab_keyboard_reply(conn, cookie, NULL);
+    bool grabbed = (reply != NULL && reply->status != XCB_GRAB_STATUS_SUCCESS);
+    free(reply);
+    return grabbed;
+}
+
+/*
+ * What happened to the command’s window so far.
+ *
+ */
+typedef struct window_state {
+    xcb_window_t window;
+    double mapped_at;
+    bool grabbed;
+    bool unmapped;
+    bool destroyed;
+} window_state_t;
+
+/*
+ * Handles the pending events. Remembers the first window which gets mapped,
+ * and whether the keyboard was grabbed and that window unmapped or destroyed
+ * since.
+ *
+ */
+static void handle_events(window_state_t *w) {
+    xcb_generic_event_t *event;
+
+    while ((event = xcb_poll_for_event(conn)) != NULL) {
+        switch (event->response_type & 0x7f) {
+            case XCB_MAP_NOTIFY:
+                if (w->window == XCB_NONE) {
+                    w->window = ((xcb_map_notify_event_t *)event)->window;
+                    w->mapped_at = now_ms();
+                }
+                break;
+            case XCB_FOCUS_IN:
+                if (((xcb_focus_in_event_t *)event)->mode == XCB_NOTIFY_MODE_GRAB)
+                    w->grabbed = true;
+                break;
+            case XCB_UNMAP_NOTIFY:
+                if (((xcb_unmap_notify_event_t *)event)->window == w->window)
+                    w->unmapped = true;
+                break;
+            case XCB_DESTROY_NOTIFY:
+                if (((xcb_destroy_notify_event_t *)event)->window == w->window)
+                    w->destroyed = true;
+                break;
+        }
+        free(event);
+    }
+}
+
+static void random_password(char *password, int len) {
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    for (int i = 0; i < len; i++)
+        password[i] = chars[rand() % (sizeof(chars) - 1)];
+    password[len] = '\0';
+}
+
+/*
+ * Locks with the command, types a password of the given length at the given
+ * rate (keys per second) and waits for the command to unlock.
+ *
+ */
+static void run_once(char **command, int len, int rate, run_t *result) {
+    char password[MAX_PASSWORD_LEN + 1];
+    window_state_t w = {.window = XCB_NONE};
+    bool exited = false;
+    int fds[2], status;
+
+    memset(result, 0, sizeof(*result));
+    result->status = RUN_FAILED;
+    random_password(password, len);
+    setenv("I3LOCK_MOCK_PASSWORD", password, 1);
+
+    /* Discard what is left over from the previous run. */
+    free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), NULL));
+    handle_events(&w);
+    memset(&w, 0, sizeof(w));
+
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDERR_FILENO);
+        execvp(command[0], command);
+        perror(command[0]);
+        _exit(127);
+    }
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    log_fd = fds[0];
+    log_len = 0;
+    log_rejected = false;
+
+    /* Wait until the screen is locked. */
+    double start = now_ms();
+    while (!(w.window != XCB_NONE && w.grabbed) && now_ms() - start < RUN_TIMEOUT) {
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            exited = true;
+            fprintf(stderr, "i3lock-stress: %s exited before locking\n", command[0]);
+            break;
+        }
+        handle_events(&w);
+        if (w.window != XCB_NONE && !w.grabbed && now_ms() - w.mapped_at > PROBE_AFTER)
+            w.grabbed = keyboard_grabbed();
+        if (!(w.window != XCB_NONE && w.grabbed) && !wait_for_event(BATCH_INTERVAL))
+            break;
+    }
+
+    if (w.window != XCB_NONE && w.grabbed) {
+        /* Only count the frames drawn while typing. */
+        wait_for_event(0);
+        log_redraws = 0;
+
+        int per_batch = (rate * BATCH_INTERVAL + 999) / 1000;
+        double next = now_ms();
+        for (int i = 0; i < len; i += per_batch) {
+            for (int j = i; j < len && j < i + per_batch; j++)
+                xtest_key((unsigned char)password[j]);
+            xcb_flush(conn);
+            result->batches++;
+
+            next += BATCH_INTERVAL;
+            while (now_ms() < next)
+                wait_for_event(next - now_ms());
+        }
+
+        /* All keys were handled once the X server answers after i3lock drew
+         * them, which takes at most a few batches. */
+        for (int i = 0; i < 5; i++)
+            wait_for_event(BATCH_INTERVAL);
+        result->redraws = log_redraws;
+
+        xtest_key(XTEST_KEYSYM_RETURN);
+        xcb_flush(conn);
+        double deadline = now_ms() + RUN_TIMEOUT;
+        while (!w.unmapped && !log_rejected && now_ms() < deadline && wait_for_event(BATCH_INTERVAL))
+            handle_events(&w);
+
+        if (w.unmapped)
+            result->status = RUN_UNLOCKED;
+        else if (log_rejected)
+            result->status = RUN_DROPPED;
+    }
+
+    double deadline = now_ms() + RUN_TIMEOUT;
+    while (!exited && result->status == RUN_UNLOCKED && now_ms() < deadline) {
+        if (waitpid(pid, &status, WNOHANG) == pid)
+            exited = true;
+        else
+            wait_for_event(1);
+    }
+    if (!exited) {
+        kill(pid, SIGTERM);
+        waitpid(pid, &status, 0);
+    }
+    if (log_fd != -1) {
+        close(log_fd);
+        log_fd = -1;
+    }
+
+    /* Wait until the X server cleaned up after the command, so that the next
+     * run does not race against it. */
+    while (w.window != XCB_NONE && !w.destroyed && now_ms() < deadline && wait_for_event(deadline - now_ms()))
+        handle_events(&w);
+    while (now_ms() < deadline && keyboard_grabbed())
+        usleep(1000);
+}
+
+static void usage(void) {
+    fprintf(stderr, "Syntax: i3lock-stress [-r runs] [-k keys per run] [-R keys per second] [-l label] -- command [args...]\n"
+                    "The command has to be i3lock with --debug, built with --enable-mock-auth.\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int runs = 5, len = 400, rate = 1000;
+    const char *label = "";
+    int o;
+    struct option longopts[] = {
+        {"runs", required_argument, NULL, 'r'},
+        {"keys", required_argument, NULL, 'k'},
+        {"rate", required_argument, NULL, 'R'},
+        {"label", required_argument, NULL, 'l'},
+        {NULL, no_argument, NULL, 0}};
+
+    while ((o = getopt_long(argc, argv, "+r:k:R:l:", longopts, NULL)) != -1) {
+        switch (o) {
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            case 'k':
+                len = atoi(optarg);
+                break;
+            case 'R':
+                rate = atoi(optarg);
+                break;
+            case 'l':
+                label = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind >= argc || runs < 1 || len < 1 || len > MAX_PASSWORD_LEN || rate < 1)
+        usage();
+    char **command = argv + optind;
+
+    int screen_number;
+    conn = xcb_connect(NULL, &screen_number);
+    if (xcb_connection_has_error(conn)) {
+        fprintf(stderr, "i3lock-stress: could not connect to the X server\n");
+        return EXIT_FAILURE;
+    }
+    xcb_screen_iterator_t iter = xcb_setup_roots_iterator(xcb_get_setup(conn));
+    for (int i = 0; i < screen_number; i++)
+        xcb_screen_next(&iter);
+    root = iter.data->root;
+
+    uint32_t mask = XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY | XCB_EVENT_MASK_FOCUS_CHANGE;
+    xcb_generic_error_t *error = xcb_request_check(
+        conn, xcb_change_window_attributes_checked(conn, root, XCB_CW_EVENT_MASK, &mask));
+    if (error != NULL) {
+        fprintf(stderr, "i3lock-stress: could not select events on the root window\n");
+        return EXIT_FAILURE;
+    }
+    if (!xtest_init(conn, root))
+        return EXIT_FAILURE;
+
+    signal(SIGPIPE, SIG_IGN);
+    srand(time(NULL) ^ getpid());
+
+    int unlocked = 0, dropped = 0, failed = 0, batches = 0, redraws = 0;
+    for (int i = 0; i < runs; i++) {
+        run_t result;
+        run_once(command, len, rate, &result);
+        switch (result.status) {
+            case RUN_UNLOCKED:
+                unlocked++;
+                break;
+            case RUN_DROPPED:
+                dropped++;
+                break;
+            case RUN_FAILED:
+                failed++;
+                continue;
+        }
+        batches += result.batches;
+        redraws += result.redraws;
+    }
+
+    /* The label is used verbatim, it is only ever a configuration name. */
+    printf("{\"label\": \"%s\", \"keys_per_run\": %d, \"keys_per_second\": %d, \"runs\": %d, "
+           "\"unlocked\": %d, \"dropped\": %d, \"failed\": %d, "
+           "\"batches\": %d, \"redraws\": %d, \"redraws_per_batch\": %.3f}\n",
+           label, len, rate, runs, unlocked, dropped, failed, batches, redraws,
+           (batches > 0 ? (double)redraws / batches : 0));
+
+    xcb_disconnect(conn);
+    return (dropped == 0 && failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
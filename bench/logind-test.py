@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+#
+# Tests the logind sleep inhibitor (see logind.c) against a mock logind on a
+# private dbus-daemon, which i3lock uses as its system bus. Checks that i3lock
+#
+#   - takes a delay inhibitor for sleep,
+#   - does so before the first frame is drawn, and
+#   - releases it only after the first frame was drawn.
+#
+# The first frame is the first "redraw_screen" line of i3lock --debug. The mock
+# runs in this process, so that i3lock's output can be read up to the moment
+# the inhibitor is released: Everything i3lock wrote before closing the
+# inhibitor is in the pipe by then.
+#
+# i3lock has to be built with libsystemd. Requires Xvfb, dbus-daemon and the
+# Python modules dbus (dbus-python) and gi (PyGObject).
+#
+# Usage: bench/logind-test.py [i3lock arguments...]
+#
+# The i3lock binary is taken from $I3LOCK (default: ./i3lock).
+#
+import fcntl
+import os
+import subprocess
+import sys
+import tempfile
+
+import dbus
+import dbus.bus
+import dbus.service
+from dbus.mainloop.glib import DBusGMainLoop
+from gi.repository import GLib
+
+TIMEOUT_MS = 10000
+
+events = []
+
+
+def fail(message):
+    print('FAIL: ' + message, file=sys.stderr)
+    sys.exit(1)
+
+
+class I3lockLog:
+    """Collects the lines i3lock writes to stderr."""
+
+    def __init__(self, pipe):
+        self.fd = pipe.fileno()
+        self.partial = b''
+        flags = fcntl.fcntl(self.fd, fcntl.F_GETFL)
+        fcntl.fcntl(self.fd, fcntl.F_SETFL, flags | os.O_NONBLOCK)
+        GLib.io_add_watch(self.fd, GLib.IO_IN | GLib.IO_HUP, self.on_readable)
+
+    def drain(self):
+        """Reads everything which is in the pipe right now."""
+        while True:
+            try:
+                data = os.read(self.fd, 65536)
+            except BlockingIOError:
+                return True
+            if not data:
+                return False
+            lines = (self.partial + data).split(b'\n')
+            self.partial = lines.pop()
+            for line in lines:
+                events.append(('log', line.decode(errors='replace')))
+
+    def on_readable(self, fd, condition):
+        return self.drain()
+
+
+class Manager(dbus.service.Object):
+    """Just enough of org.freedesktop.login1.Manager for i3lock."""
+
+    def __init__(self, bus):
+        name = dbus.service.BusName('org.freedesktop.login1', bus)
+        super().__init__(name, '/org/freedesktop/login1')
+        self.log = None
+
+    @dbus.service.method('org.freedesktop.login1.Manager',
+                         in_signature='ssss', out_signature='h')
+    def Inhibit(self, what, who, why, mode):
+        events.append(('inhibit', (str(what), str(who), str(why), str(mode))))
+        read_end, write_end = os.pipe()
+        GLib.io_add_watch(read_end, GLib.IO_IN | GLib.IO_HUP, self.on_released)
+        # UnixFd duplicates the descriptor, so that i3lock holds the only one.
+        fd = dbus.types.UnixFd(write_end)
+        os.close(write_end)
+        return fd
+
+    def on_released(self, fd, condition):
+        if os.read(fd, 1):
+            return True
+        os.close(fd)
+        # i3lock drew the first frame before it closed the inhibitor.
+        self.log.drain()
+        events.append(('release', None))
+        return False
+
+
+def check():
+    inhibits = [i for i, (kind, _) in enumerate(events) if kind == 'inhibit']
+    releases = [i for i, (kind, _) in enumerate(events) if kind == 'release']
+    frames = [i for i, (kind, line) in enumerate(events)
+              if kind == 'log' and 'redraw_screen(' in line]
+
+    if not inhibits:
+        fail('i3lock did not take an inhibitor')
+    if len(inhibits) > 1:
+        fail('i3lock took %d inhibitors' % len(inhibits))
+    what, who, why, mode = events[inhibits[0]][1]
+    if what != 'sleep' or mode != 'delay':
+        fail('expected a delay inhibitor for sleep, got %s/%s' % (what, mode))
+    if not frames:
+        fail('i3lock did not draw a frame')
+    if inhibits[0] > frames[0]:
+        fail('the inhibitor was taken after the first frame')
+    if not releases:
+        fail('i3lock did not release the inhibitor')
+    if releases[0] < frames[0]:
+        fail('the inhibitor was released before the first frame')
+    print('OK: inhibitor taken before the first frame and released after it')
+
+
+def main():
+    i3lock = os.environ.get('I3LOCK', './i3lock')
+    with tempfile.TemporaryDirectory() as tmp:
+        # Xvfb writes the display number once it accepts connections.
+        fifo = os.path.join(tmp, 'displayfd')
+        os.mkfifo(fifo)
+        xvfb = subprocess.Popen('exec Xvfb -displayfd 3 -nolisten tcp 3>"%s"' % fifo,
+                                shell=True, stderr=subprocess.DEVNULL)
+        bus_process = None
+        try:
+            with open(fifo) as f:
+                display = f.readline().strip()
+            if not display:
+                fail('Xvfb did not start')
+
+            bus_process = subprocess.Popen(
+                ['dbus-daemon', '--session', '--nofork', '--print-address'],
+                stdout=subprocess.PIPE)
+            address = bus_process.stdout.readline().decode().strip()
+            if not address:
+                fail('dbus-daemon did not start')
+
+            DBusGMainLoop(set_as_default=True)
+            bus = dbus.bus.BusConnection(address)
+            # The name has to be taken before i3lock asks for it.
+            manager = Manager(bus)
+
+            env = dict(os.environ, DISPLAY=':' + display,
+                       DBUS_SYSTEM_BUS_ADDRESS=address)
+            process = subprocess.Popen([i3lock, '-n', '--debug'] + sys.argv[1:],
+                                       env=env, stderr=subprocess.PIPE)
+            manager.log = I3lockLog(process.stderr)
+
+            loop = GLib.MainLoop()
+            GLib.timeout_add(TIMEOUT_MS, loop.quit)
+
+            def stop_when_released():
+                if any(kind == 'release' for kind, _ in events):
+                    loop.quit()
+                    return False
+                return True
+            GLib.timeout_add(50, stop_when_released)
+            loop.run()
+
+            process.terminate()
+            process.wait()
+            check()
+        finally:
+            if bus_process is not None:
+                bus_process.terminate()
+            xvfb.terminate()
+
+
+if __name__ == '__main__':
+    main()
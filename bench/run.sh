@@ -0,0 +1,140 @@
+#!/bin/sh
+#
+# Measures the time to lock (see i3lock-bench.c) for a set of typical
+# configurations on a private Xvfb and prints the results as a JSON array, one
+# object per configuration:
+#
+#   color      no image
+#   png        a PNG image of the screen size
+#   raw        a raw image (--raw) of the screen size
+#   tiling     a small PNG image, tiled (-t)
+#   monitors   like png, with the screen split into several RandR monitors
+#   unlock     like png, then types the password and also measures the time
+#              from pressing Enter until the desktop is visible
+#   memory     like png, also measures the memory use once locked (rss_kb and
+#              pss_kb, summed over i3lock and the processes it started)
+#   stress     types passwords at 1000 keys/s (see i3lock-stress.c), checks
+#              that no key is lost and counts the frames drawn per batch
+#
+# i3lock should be built with --enable-mock-auth, so that PAM is not involved.
+# The unlock configuration types $I3LOCK_MOCK_PASSWORD (default: i3lock), and
+# $I3LOCK_MOCK_SETCRED_LATENCY (e.g. 300) simulates a slow pam_setcred().
+# Requires Xvfb and xrandr (for the monitors configuration).
+#
+# Usage: bench/run.sh [-r runs] [-s <width>x<height>] [-m monitors]
+#                     [-c configurations] [-o output file]
+#
+# e.g. “bench/run.sh -r 200 -s 3840x2160 -c 'png raw'”. The i3lock,
+# i3lock-bench and i3lock-stress binaries are taken from $I3LOCK, $I3LOCK_BENCH
+# and $I3LOCK_STRESS (default: the current directory), extra i3lock arguments
+# from $I3LOCK_ARGS.
+#
+set -e
+
+runs=50
+size=1920x1080
+monitors=2
+configs="color png raw tiling monitors unlock memory stress"
+output=-
+
+while getopts r:s:m:c:o: opt; do
+    case $opt in
+        r) runs=$OPTARG ;;
+        s) size=$OPTARG ;;
+        m) monitors=$OPTARG ;;
+        c) configs=$OPTARG ;;
+        o) output=$OPTARG ;;
+        *) sed -n 's/^# Usage: //p' "$0" >&2; exit 1 ;;
+    esac
+done
+
+i3lock=${I3LOCK:-./i3lock}
+bench=${I3LOCK_BENCH:-./i3lock-bench}
+stress=${I3LOCK_STRESS:-./i3lock-stress}
+width=${size%x*}
+height=${size#*x}
+
+tmp=$(mktemp -d)
+xvfb_pid=
+cleanup() {
+    [ -n "$xvfb_pid" ] && kill "$xvfb_pid" 2>/dev/null
+    rm -rf "$tmp"
+}
+trap cleanup EXIT INT TERM
+
+# Xvfb writes the display number once it accepts connections.
+mkfifo "$tmp/displayfd"
+Xvfb -displayfd 3 -screen 0 "${size}x24" -nolisten tcp +extension RANDR \
+    3>"$tmp/displayfd" 2>"$tmp/xvfb.log" &
+xvfb_pid=$!
+if ! read -r display <"$tmp/displayfd"; then
+    cat "$tmp/xvfb.log" >&2
+    exit 1
+fi
+export DISPLAY=":$display"
+
+"$bench" --png="$tmp/screen.png" --size="$size"
+"$bench" --png="$tmp/tile.png" --size=256x256
+# Any bytes do for a raw image, only its size matters.
+head -c $((width * height * 3)) /dev/urandom >"$tmp/screen.raw"
+
+# Splits the screen into the given number of monitors, the first of which
+# takes over the output (replacing its automatic monitor).
+set_monitors() {
+    output_name=$(xrandr | awk '/ connected/ { print $1; exit }')
+    w=$((width / $1))
+    i=0
+    while [ "$i" -lt "$1" ]; do
+        [ "$i" -eq 0 ] && outputs=$output_name || outputs=none
+        xrandr --setmonitor "BENCH-$i" "${w}/${w}x${height}/${height}+$((i * w))+0" "$outputs"
+        i=$((i + 1))
+    done
+}
+
+unset_monitors() {
+    i=0
+    while [ "$i" -lt "$1" ]; do
+        xrandr --delmonitor "BENCH-$i"
+        i=$((i + 1))
+    done
+}
+
+[ "$output" = - ] || exec >"$output"
+separator="["
+for config in $configs; do
+    case $config in
+        color)    args="" ;;
+        png)      args="-i $tmp/screen.png" ;;
+        raw)      args="-i $tmp/screen.raw --raw=${size}:rgb" ;;
+        tiling)   args="-t -i $tmp/tile.png" ;;
+        monitors) args="-i $tmp/screen.png" ;;
+        unlock)   args="-i $tmp/screen.png" ;;
+        memory)   args="-i $tmp/screen.png" ;;
+        stress)   args="-i $tmp/screen.png" ;;
+        *) echo "unknown configuration $config" >&2; exit 1 ;;
+    esac
+    if [ "$config" = monitors ]; then
+        set_monitors "$monitors"
+    fi
+
+    bench_args=
+    if [ "$config" = unlock ]; then
+        bench_args="-u ${I3LOCK_MOCK_PASSWORD:-i3lock}"
+    elif [ "$config" = memory ]; then
+        bench_args="-m"
+    fi
+
+    printf '%s\n' "$separator"
+    # shellcheck disable=SC2086
+    if [ "$config" = stress ]; then
+        "$stress" -r "$runs" -l "$config" -- "$i3lock" -n --debug $args $I3LOCK_ARGS
+    else
+        "$bench" -r "$runs" -l "$config" $bench_args -- "$i3lock" -n $args $I3LOCK_ARGS
+    fi
+    separator=","
+
+    if [ "$config" = monitors ]; then
+        unset_monitors "$monitors"
+    fi
+done
+echo "]"
@@ -0,0 +1,120 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * xtest.c: types keys into the X server using the XTEST extension, as if they
+ *          were pressed on the keyboard, so that the benchmarks can enter
+ *          passwords. The events go to whichever client grabbed the keyboard.
+ *
+ * Only keysyms which the server’s keymap has on a key (with or without Shift)
+ * can be typed, and text is limited to printable ASCII, whose keysyms equal
+ * the characters.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <xcb/xcb.h>
+#include <xcb/xtest.h>
+
+#include "xtest.h"
+
+#define XTEST_KEYSYM_SHIFT_L 0xffe1
+
+static xcb_connection_t *conn;
+static xcb_window_t root;
+static xcb_get_keyboard_mapping_reply_t *mapping;
+static xcb_keycode_t min_keycode;
+static xcb_keycode_t shift_keycode;
+
+/*
+ * Finds the key which produces the given keysym in the given column (0 is
+ * without modifiers, 1 with Shift). Returns 0 if there is none.
+ *
+ */
+static xcb_keycode_t find_keycode(xcb_keysym_t keysym, int column) {
+    const xcb_keysym_t *keysyms = xcb_get_keyboard_mapping_keysyms(mapping);
+    int per_keycode = mapping->keysyms_per_keycode;
+    int num_keycodes = xcb_get_keyboard_mapping_keysyms_length(mapping) / per_keycode;
+
+    if (column >= per_keycode)
+        return 0;
+    for (int i = 0; i < num_keycodes; i++) {
+        if (keysyms[i * per_keycode + column] == keysym)
+            return min_keycode + i;
+    }
+    return 0;
+}
+
+static void fake_key(uint8_t type, xcb_keycode_t keycode) {
+    xcb_test_fake_input(conn, type, keycode, XCB_CURRENT_TIME, root, 0, 0, 0);
+}
+
+/*
+ * Checks for the XTEST extension and fetches the keymap. Returns false if
+ * keys cannot be typed.
+ *
+ */
+bool xtest_init(xcb_connection_t *c, xcb_window_t r) {
+    conn = c;
+    root = r;
+
+    const xcb_query_extension_reply_t *extension = xcb_get_extension_data(conn, &xcb_test_id);
+    if (extension == NULL || !extension->present) {
+        fprintf(stderr, "xtest: the X server does not support the XTEST extension\n");
+        return false;
+    }
+
+    const xcb_setup_t *setup = xcb_get_setup(conn);
+    min_keycode = setup->min_keycode;
+    mapping = xcb_get_keyboard_mapping_reply(
+        conn, xcb_get_keyboard_mapping(conn, min_keycode, setup->max_keycode - min_keycode + 1), NULL);
+    if (mapping == NULL || mapping->keysyms_per_keycode == 0) {
+        fprintf(stderr, "xtest: could not get the keyboard mapping\n");
+        return false;
+    }
+
+    shift_keycode = find_keycode(XTEST_KEYSYM_SHIFT_L, 0);
+    return true;
+}
+
+/*
+ * Presses and releases the key which produces the given keysym, holding Shift
+ * if necessary. The requests are only queued, the caller flushes them.
+ *
+ */
+bool xtest_key(xcb_keysym_t keysym) {
+    bool shift = false;
+    xcb_keycode_t keycode = find_keycode(keysym, 0);
+
+    if (keycode == 0 && shift_keycode != 0) {
+        keycode = find_keycode(keysym, 1);
+        shift = true;
+    }
+    if (keycode == 0) {
+        fprintf(stderr, "xtest: no key produces keysym 0x%x\n", keysym);
+        return false;
+    }
+
+    if (shift)
+        fake_key(XCB_KEY_PRESS, shift_keycode);
+    fake_key(XCB_KEY_PRESS, keycode);
+    fake_key(XCB_KEY_RELEASE, keycode);
+    if (shift)
+        fake_key(XCB_KEY_RELEASE, shift_keycode);
+    return true;
+}
+
+bool xtest_type(const char *text) {
+    for (; *text != '\0'; text++) {
+        if (*text < 0x20 || *text > 0x7e) {
+            fprintf(stderr, "xtest: cannot type character 0x%02x\n", (unsigned char)*text);
+            return false;
+        }
+        if (!xtest_key((unsigned char)*text))
+            return false;
+    }
+    return true;
+}
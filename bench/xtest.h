@@ -0,0 +1,13 @@
+#ifndef _XTEST_H
+#define _XTEST_H
+
+#include <stdbool.h>
+#include <xcb/xcb.h>
+
+#define XTEST_KEYSYM_RETURN 0xff0d
+
+bool xtest_init(xcb_connection_t *conn, xcb_window_t root);
+bool xtest_key(xcb_keysym_t keysym);
+bool xtest_type(const char *text);
+
+#endif
@@ -0,0 +1,333 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * control.c: an optional UNIX socket (see --socket) which status bars and idle
+ *            daemons can ask whether the screen is locked, instead of polling
+ *            for the process. Every line sent to the socket is a command:
+ *
+ *   status      answers with one line, e.g.
+ *               “state=locked failed_attempts=0 uptime=42”
+ *               (uptime is the number of seconds since locking)
+ *   subscribe   answers like status, then sends the new state (“locked”,
+ *               “verifying”, “wrong” or “unlocked”) on a line of its own
+ *               whenever it changes
+ *   lock        locks the screen (only in --daemon mode), answers “ok” once
+ *               it is locked, or an error
+ *
+ * The socket is served from the main loop and never blocks it: A client which
+ * does not read its replies is disconnected once its socket buffer is full.
+ *
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <ev.h>
+
+#include "i3lock.h"
+#include "control.h"
+
+#define CONTROL_MAX_CLIENTS 16
+#define CONTROL_LINE_SIZE 64
+
+extern bool debug_mode;
+extern int failed_attempts;
+
+typedef struct control_client {
+    /* -1 while the slot is unused. */
+    int fd;
+    bool subscribed;
+    /* Lock commands which are not answered yet. */
+    int pending_locks;
+    struct ev_io watcher;
+    size_t len;
+    char line[CONTROL_LINE_SIZE];
+} control_client_t;
+
+static const char *state_names[] = {
+    [CONTROL_LOCKED] = "locked",
+    [CONTROL_VERIFYING] = "verifying",
+    [CONTROL_WRONG] = "wrong",
+    [CONTROL_UNLOCKED] = "unlocked",
+};
+
+static struct ev_loop *control_loop;
+static control_lock_cb_t lock_cb;
+static struct ev_io listener;
+static const char *socket_path;
+static control_client_t clients[CONTROL_MAX_CLIENTS];
+static control_state_t state = CONTROL_LOCKED;
+static ev_tstamp locked_at;
+
+static bool set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return (flags != -1 &&
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1 &&
+            fcntl(fd, F_SETFD, FD_CLOEXEC) != -1);
+}
+
+/*
+ * Removes a socket which was left behind at the given path by an i3lock which
+ * did not exit cleanly. Anything else (a regular file, a socket which somebody
+ * still listens on) is left alone. Returns false if the path cannot be used.
+ *
+ */
+static bool remove_stale_socket(const char *path, const struct sockaddr_un *addr) {
+    struct stat st;
+
+    if (lstat(path, &st) == -1)
+        return (errno == ENOENT);
+
+    if (!S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "[i3lock] %s exists and is not a socket\n", path);
+        return false;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return false;
+    }
+    int result = connect(fd, (const struct sockaddr *)addr, sizeof(*addr));
+    int saved_errno = errno;
+    close(fd);
+
+    if (result == 0) {
+        fprintf(stderr, "[i3lock] %s is in use, is i3lock already running?\n", path);
+        return false;
+    }
+    if (saved_errno != ECONNREFUSED) {
+        errno = saved_errno;
+        perror(path);
+        return false;
+    }
+
+    DEBUG("control: removing stale socket %s\n", path);
+    if (unlink(path) == -1 && errno != ENOENT) {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+static void client_close(control_client_t *c) {
+    ev_io_stop(control_loop, &c->watcher);
+    close(c->fd);
+    c->fd = -1;
+}
+
+/*
+ * Sends the given line without waiting. A client which cannot take it right
+ * away is disconnected.
+ *
+ */
+static void client_send(control_client_t *c, const char *text) {
+    size_t len = strlen(text);
+    ssize_t n;
+
+    do {
+        n = send(c->fd, text, len, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+
+    if (n != (ssize_t)len) {
+        DEBUG("control: disconnecting client %d, it does not read\n", c->fd);
+        client_close(c);
+    }
+}
+
+static void send_status(control_client_t *c) {
+    char text[128];
+    snprintf(text, sizeof(text), "state=%s failed_attempts=%d uptime=%.0f\n",
+             state_names[state], failed_attempts, ev_now(control_loop) - locked_at);
+    client_send(c, text);
+}
+
+static void handle_command(control_client_t *c, const char *command) {
+    if (strcmp(command, "status") == 0) {
+        send_status(c);
+    } else if (strcmp(command, "subscribe") == 0) {
+        c->subscribed = true;
+        send_status(c);
+    } else if (strcmp(command, "lock") == 0 && lock_cb != NULL) {
+        /* Grabbing may take a while, control_lock_done() answers. */
+        c->pending_locks++;
+        lock_cb();
+    } else if (*command != '\0') {
+        client_send(c, "error unknown command\n");
+    }
+}
+
+static void client_cb(EV_P_ ev_io *w, int revents) {
+    control_client_t *c = w->data;
+    ssize_t n = read(c->fd, c->line + c->len, sizeof(c->line) - c->len);
+
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n <= 0) {
+        client_close(c);
+        return;
+    }
+    c->len += n;
+
+    char *newline;
+    while (c->fd != -1 && (newline = memchr(c->line, '\n', c->len)) != NULL) {
+        *newline = '\0';
+        if (newline > c->line && newline[-1] == '\r')
+            newline[-1] = '\0';
+        handle_command(c, c->line);
+
+        size_t used = newline + 1 - c->line;
+        memmove(c->line, newline + 1, c->len - used);
+        c->len -= used;
+    }
+
+    if (c->fd != -1 && c->len == sizeof(c->line)) {
+        DEBUG("control: disconnecting client %d, command too long\n", c->fd);
+        client_close(c);
+    }
+}
+
+static void accept_cb(EV_P_ ev_io *w, int revents) {
+    int fd = accept(w->fd, NULL, NULL);
+    if (fd == -1)
+        return;
+
+    control_client_t *c = NULL;
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        if (clients[i].fd == -1) {
+            c = &clients[i];
+            break;
+        }
+    }
+    if (c == NULL) {
+        DEBUG("control: rejecting client, too many connections\n");
+        close(fd);
+        return;
+    }
+    if (!set_nonblocking(fd)) {
+        close(fd);
+        return;
+    }
+
+    c->fd = fd;
+    c->subscribed = false;
+    c->pending_locks = 0;
+    c->len = 0;
+    ev_io_init(&c->watcher, client_cb, fd, EV_READ);
+    c->watcher.data = c;
+    ev_io_start(control_loop, &c->watcher);
+}
+
+/*
+ * Listens on a UNIX socket at the given path, which only the user can connect
+ * to. A socket which nobody listens on anymore is replaced, anything else at
+ * that path makes this fail. The lock command calls cb, unless it is NULL.
+ * Returns false if that failed.
+ *
+ */
+bool control_init(struct ev_loop *loop, const char *path, control_lock_cb_t cb) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "[i3lock] socket path \"%s\" is too long\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    if (!remove_stale_socket(path, &addr))
+        return false;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return false;
+    }
+
+    mode_t old_umask = umask(077);
+    int result = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (result == -1 || listen(fd, CONTROL_MAX_CLIENTS) == -1 || !set_nonblocking(fd)) {
+        perror(path);
+        close(fd);
+        return false;
+    }
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+        clients[i].fd = -1;
+
+    control_loop = loop;
+    lock_cb = cb;
+    socket_path = path;
+    locked_at = ev_now(loop);
+    ev_io_init(&listener, accept_cb, fd, EV_READ);
+    ev_io_start(loop, &listener);
+    DEBUG("control: listening on %s\n", path);
+    return true;
+}
+
+/*
+ * Records the new state and tells all subscribers about it.
+ *
+ */
+void control_set_state(control_state_t new_state) {
+    if (new_state == state)
+        return;
+    if (state == CONTROL_UNLOCKED && control_loop != NULL)
+        locked_at = ev_now(control_loop);
+    state = new_state;
+
+    if (socket_path == NULL)
+        return;
+
+    char text[16];
+    snprintf(text, sizeof(text), "%s\n", state_names[state]);
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        if (clients[i].fd != -1 && clients[i].subscribed)
+            client_send(&clients[i], text);
+    }
+}
+
+/*
+ * Answers all lock commands which wait for the screen to be locked. Subscribers
+ * were told about the new state already.
+ *
+ */
+void control_lock_done(bool locked) {
+    if (socket_path == NULL)
+        return;
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        /* Sending may disconnect the client. */
+        while (clients[i].fd != -1 && clients[i].pending_locks > 0) {
+            clients[i].pending_locks--;
+            client_send(&clients[i], locked ? "ok\n" : "error could not lock\n");
+        }
+    }
+}
+
+/*
+ * Disconnects all clients and removes the socket.
+ *
+ */
+void control_cleanup(void) {
+    if (socket_path == NULL)
+        return;
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        if (clients[i].fd != -1)
+            client_close(&clients[i]);
+    }
+    ev_io_stop(control_loop, &listener);
+    close(listener.fd);
+    unlink(socket_path);
+    socket_path = NULL;
+}
@@ -0,0 +1,23 @@
+#ifndef _CONTROL_H
+#define _CONTROL_H
+
+#include <stdbool.h>
+#include <ev.h>
+
+typedef enum {
+    CONTROL_LOCKED = 0,
+    CONTROL_VERIFYING,
+    CONTROL_WRONG,
+    CONTROL_UNLOCKED,
+} control_state_t;
+
+/* Starts locking the screen (in --daemon mode). The result is reported with
+ * control_lock_done(), possibly before this returns. */
+typedef void (*control_lock_cb_t)(void);
+
+bool control_init(struct ev_loop *loop, const char *path, control_lock_cb_t cb);
+void control_set_state(control_state_t state);
+void control_lock_done(bool locked);
+void control_cleanup(void);
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * display.c: lets one i3lock process lock several X displays. The modules
+ *            which draw and set up a screen were written for a single display
+ *            and keep its connection, window etc. in globals (listed in
+ *            DISPLAY_STATE). display_select() stores these globals in the
+ *            display they belong to and loads the ones of another display, so
+ *            that this code works on whichever display is selected. The event
+ *            handlers get the display passed instead and use its fields.
+ *
+ *            A display with several X screens is locked using one entry per
+ *            screen, all of which share the connection of the first one.
+ *
+ *            Everything else (the password, the authentication backend, the
+ *            decoded image, the compose table) is shared by all displays.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <xcb/xcb.h>
+#include <xkbcommon/xkbcommon.h>
+
+#include "display.h"
+
+lock_display_t displays[MAX_DISPLAYS];
+int num_displays = 0;
+lock_display_t *current_display = NULL;
+
+/*
+ * Adds a display which is not connected yet. Returns NULL when there already
+ * are MAX_DISPLAYS.
+ *
+ */
+lock_display_t *display_add(const char *name) {
+    if (num_displays == MAX_DISPLAYS)
+        return NULL;
+
+    lock_display_t *d = &displays[num_displays++];
+    memset(d, 0, sizeof(lock_display_t));
+    d->name = name;
+    d->xkb_device_id = -1;
+    d->randr_base = -1;
+    d->screensaver_base = -1;
+    return d;
+}
+
+/* memcpy() also covers arrays such as last_resolution. */
+#define DISPLAY_STATE_SAVE(type, name) memcpy(&d->name, &name, sizeof(type));
+#define DISPLAY_STATE_LOAD(type, name) memcpy(&name, &d->name, sizeof(type));
+
+static void display_save(lock_display_t *d) {
+    DISPLAY_STATE(DISPLAY_STATE_SAVE)
+}
+
+static void display_load(lock_display_t *d) {
+    DISPLAY_STATE(DISPLAY_STATE_LOAD)
+}
+
+/*
+ * Makes the given display the one all globals refer to.
+ *
+ */
+void display_select(lock_display_t *d) {
+    if (d == current_display)
+        return;
+
+    if (current_display != NULL)
+        display_save(current_display);
+    display_load(d);
+    current_display = d;
+}
+
+/*
+ * Stores the globals in the selected display, so that the fields of all
+ * displays are up to date.
+ *
+ */
+void display_sync(void) {
+    if (current_display != NULL)
+        display_save(current_display);
+}
+
+/*
+ * Returns the screen of the selected display’s connection which the given
+ * lock window or root window belongs to, or NULL.
+ *
+ */
+lock_display_t *display_for_window(xcb_window_t window) {
+    display_sync();
+    for (int i = 0; i < num_displays; i++) {
+        lock_display_t *d = &displays[i];
+        if (d->owner != current_display->owner)
+            continue;
+        if (d->win == window || d->screen->root == window)
+            return d;
+    }
+    return NULL;
+}
@@ -0,0 +1,101 @@
+#ifndef _DISPLAY_H
+#define _DISPLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xcb/xcb.h>
+#include <xkbcommon/xkbcommon.h>
+#include <ev.h>
+
+#include "randr.h"
+
+/* The number of X screens which can be locked at once, see --display. */
+#define MAX_DISPLAYS 16
+
+typedef uint32_t resolution_t[2];
+
+/* The globals which belong to one X screen, as X(type, name). The modules which
+ * draw and set up a screen were written for a single one and use these, so
+ * display_select() swaps them. This is the only list of them: The fields of
+ * lock_display_t, their declarations and the swapping code are all generated
+ * from it, so a global which is added here cannot be forgotten in one of them.
+ *
+ * State which event handlers use does not belong here, but into the explicit
+ * fields of lock_display_t, see below. */
+#define DISPLAY_STATE(X)                               \
+    /* xcb.c */                                        \
+    X(xcb_connection_t *, conn)                        \
+    X(xcb_screen_t *, screen)                          \
+    X(xcb_atom_t, _NET_WM_BYPASS_COMPOSITOR)           \
+    X(xcb_atom_t, _NET_ACTIVE_WINDOW)                  \
+    /* i3lock.c */                                     \
+    X(xcb_window_t, win)                               \
+    X(xcb_cursor_t, cursor)                            \
+    X(resolution_t, last_resolution)                   \
+    /* unlock_indicator.c */                           \
+    X(xcb_visualtype_t *, vistype)                     \
+    X(xcb_pixmap_t, bg_pixmap)                         \
+    /* randr.c */                                      \
+    X(int, xr_screens)                                 \
+    X(Rect *, xr_resolutions)                          \
+    X(bool, xinerama_active)                           \
+    X(bool, has_randr)                                 \
+    X(bool, has_randr_1_5)                             \
+    /* dpms.c, dpi.c */                                \
+    X(bool, has_dpms)                                  \
+    X(long, dpi)
+
+#define DISPLAY_STATE_DECLARE(type, name) extern type name;
+DISPLAY_STATE(DISPLAY_STATE_DECLARE)
+#undef DISPLAY_STATE_DECLARE
+
+/* Everything which belongs to one X screen. While a display is selected, the
+ * fields from DISPLAY_STATE live in the globals of the same name instead.
+ *
+ * Every screen of a multi-screen display gets its own entry. The entry of the
+ * display’s default screen (its owner) holds the keyboard and pointer grab and
+ * handles the events of all of them, the others only have a lock window. */
+typedef struct lock_display {
+    /* The name as given with --display, NULL for $DISPLAY. */
+    const char *name;
+    /* The entry which owns the connection, NULL while not connected. */
+    struct lock_display *owner;
+    /* Set when the connection broke, the display is ignored from then on. */
+    bool broken;
+    struct ev_io watcher;
+    xcb_window_t stolen_focus;
+
+#define DISPLAY_STATE_FIELD(type, name) type name;
+    DISPLAY_STATE(DISPLAY_STATE_FIELD)
+#undef DISPLAY_STATE_FIELD
+
+    /* The state of the event handlers, which get the display passed. These
+     * are never swapped, so they are always up to date. Only the owner has a
+     * keymap, the other screens share it. */
+    struct xkb_keymap *xkb_keymap;
+    struct xkb_state *xkb_state;
+    /* The core keyboard, as of the last keymap load. */
+    int32_t xkb_device_id;
+    /* A keymap change arrived, see schedule_keymap_reload(). */
+    bool keymap_stale;
+    struct keytable *keytable;
+    uint8_t xkb_base_event;
+    uint8_t xkb_base_error;
+    int randr_base;
+    int screensaver_base;
+    /* Whether the display is blanked (by DPMS or the screen saver). Nothing
+     * is drawn meanwhile, redraw_screen() only counts the frames it skipped. */
+    bool display_off;
+    int skipped_redraws;
+} lock_display_t;
+
+extern lock_display_t displays[MAX_DISPLAYS];
+extern int num_displays;
+extern lock_display_t *current_display;
+
+lock_display_t *display_add(const char *name);
+void display_select(lock_display_t *d);
+void display_sync(void);
+lock_display_t *display_for_window(xcb_window_t window);
+
+#endif
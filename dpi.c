@@ -10,16 +10,56 @@
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <xcb/xcb_xrm.h>
 #include "xcb.h"
 #include "i3lock.h"
+#include "display.h"
 
 extern bool debug_mode;
 
-static long dpi;
+long dpi;
 
 extern xcb_screen_t *screen;
 
+/* Sent by dpi_prefetch(), 0 if not outstanding. */
+static xcb_get_property_cookie_t resources_cookie;
+
+/*
+ * Asks for the resource database (the RESOURCE_MANAGER property, like
+ * xcb_xrm_database_from_default() does) without waiting for the reply, which
+ * init_dpi() reads.
+ */
+void dpi_prefetch(void) {
+    xcb_window_t root = xcb_setup_roots_iterator(xcb_get_setup(conn)).data->root;
+    resources_cookie = xcb_get_property(conn, 0, root, XCB_ATOM_RESOURCE_MANAGER,
+                                        XCB_ATOM_STRING, 0, UINT32_MAX);
+}
+
+static xcb_xrm_database_t *load_database(void) {
+    if (resources_cookie.sequence == 0) {
+        round_trips++;
+        return xcb_xrm_database_from_default(conn);
+    }
+
+    xcb_get_property_reply_t *reply = xcb_get_property_reply(conn, resources_cookie, NULL);
+    resources_cookie.sequence = 0;
+    if (reply == NULL || xcb_get_property_value_length(reply) == 0) {
+        /* Let xcb-xrm fall back to ~/.Xresources. */
+        free(reply);
+        return xcb_xrm_database_from_default(conn);
+    }
+
+    char *resources = strndup(xcb_get_property_value(reply), xcb_get_property_value_length(reply));
+    free(reply);
+    if (resources == NULL)
+        return NULL;
+
+    xcb_xrm_database_t *database = xcb_xrm_database_from_string(resources);
+    free(resources);
+    return database;
+}
+
 static long init_dpi_fallback(void) {
     return (double)screen->height_in_pixels * 25.4 / (double)screen->height_in_millimeters;
 }
@@ -37,7 +77,7 @@ void init_dpi(void) {
         goto init_dpi_end;
     }
 
-    database = xcb_xrm_database_from_default(conn);
+    database = load_database();
     if (database == NULL) {
         DEBUG("Failed to open the resource database.\n");
         goto init_dpi_end;
@@ -1,5 +1,10 @@
 #pragma once
 
+/**
+ * Asks for the resource database without waiting for it.
+ */
+void dpi_prefetch(void);
+
 /**
  * Initialize the DPI setting.
  * This will use the 'Xft.dpi' X resource if available and fall back to
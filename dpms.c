@@ -0,0 +1,102 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * dpms.c: finds out whether the display is blanked, either by the screen
+ *         saver (MIT-SCREEN-SAVER, which sends events when it activates) or by
+ *         DPMS (which has to be queried).
+ *
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <xcb/xcb.h>
+#include <xcb/dpms.h>
+#include <xcb/screensaver.h>
+
+#include "i3lock.h"
+#include "xcb.h"
+#include "dpms.h"
+#include "display.h"
+
+bool has_dpms = false;
+extern bool debug_mode;
+
+/* Sent by dpms_prefetch(), 0 if not outstanding. */
+static xcb_dpms_capable_cookie_t capable_cookie;
+
+/*
+ * Asks whether the server supports DPMS without waiting for the reply, which
+ * dpms_init() reads. The extension data needs to be prefetched.
+ *
+ */
+void dpms_prefetch(void) {
+    if (xcb_get_extension_data(conn, &xcb_dpms_id)->present)
+        capable_cookie = xcb_dpms_capable(conn);
+}
+
+/*
+ * Selects screen saver notifications on the given root window and sets
+ * *event_base to the first screen saver event. Leaves *event_base alone when
+ * the extension is not present.
+ *
+ */
+void dpms_init(int *event_base, xcb_window_t root) {
+    const xcb_query_extension_reply_t *extreply;
+
+    extreply = xcb_get_extension_data(conn, &xcb_screensaver_id);
+    if (extreply->present) {
+        if (event_base != NULL)
+            *event_base = extreply->first_event;
+        xcb_screensaver_select_input(conn, root, XCB_SCREENSAVER_EVENT_NOTIFY_MASK);
+    } else {
+        DEBUG("MIT-SCREEN-SAVER is not present, not listening for the screen saver.\n");
+    }
+
+    if (!xcb_get_extension_data(conn, &xcb_dpms_id)->present) {
+        DEBUG("DPMS is not present.\n");
+        return;
+    }
+
+    if (capable_cookie.sequence == 0) {
+        capable_cookie = xcb_dpms_capable(conn);
+        round_trips++;
+    }
+    xcb_dpms_capable_reply_t *capable = xcb_dpms_capable_reply(conn, capable_cookie, NULL);
+    capable_cookie.sequence = 0;
+    has_dpms = (capable != NULL && capable->capable);
+    free(capable);
+    DEBUG("DPMS capable: %d\n", has_dpms);
+}
+
+/*
+ * Returns true if the display is blanked, either by DPMS (standby, suspend or
+ * off) or by the screen saver. DPMS does not send events, so this has to be
+ * polled. Both queries share one round trip. event_base is the one which
+ * dpms_init() set, the screen saver is not asked when it is -1.
+ *
+ */
+bool dpms_display_off(int event_base) {
+    xcb_dpms_info_cookie_t info_cookie = {0};
+    xcb_screensaver_query_info_cookie_t saver_cookie = {0};
+    bool off = false;
+
+    if (has_dpms)
+        info_cookie = xcb_dpms_info(conn);
+    if (event_base > -1)
+        saver_cookie = xcb_screensaver_query_info(conn, screen->root);
+
+    if (has_dpms) {
+        xcb_dpms_info_reply_t *info = xcb_dpms_info_reply(conn, info_cookie, NULL);
+        off = (info != NULL && info->state && info->power_level != XCB_DPMS_DPMS_MODE_ON);
+        free(info);
+    }
+    if (event_base > -1) {
+        xcb_screensaver_query_info_reply_t *saver =
+            xcb_screensaver_query_info_reply(conn, saver_cookie, NULL);
+        off |= (saver != NULL && saver->state == XCB_SCREENSAVER_STATE_ON);
+        free(saver);
+    }
+    return off;
+}
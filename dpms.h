@@ -0,0 +1,11 @@
+#ifndef _DPMS_H
+#define _DPMS_H
+
+#include <stdbool.h>
+#include <xcb/xcb.h>
+
+void dpms_prefetch(void);
+void dpms_init(int *event_base, xcb_window_t root);
+bool dpms_display_off(int event_base);
+
+#endif
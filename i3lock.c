@@ -21,80 +21,169 @@
 #include <err.h>
 #include <errno.h>
 #include <assert.h>
-#ifdef __OpenBSD__
-#include <bsd_auth.h>
-#else
-#include <security/pam_appl.h>
-#endif
+#include <signal.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <ev.h>
-#include <sys/mman.h>
 #include <xkbcommon/xkbcommon.h>
 #include <xkbcommon/xkbcommon-compose.h>
 #include <xkbcommon/xkbcommon-x11.h>
 #include <cairo.h>
 #include <cairo/cairo-xcb.h>
-#ifdef HAVE_EXPLICIT_BZERO
-#include <strings.h> /* explicit_bzero(3) */
-#endif
 #include <xcb/xcb_aux.h>
+#include <xcb/xcbext.h>
 #include <xcb/randr.h>
+#include <xcb/xinerama.h>
+#include <xcb/dpms.h>
+#include <xcb/screensaver.h>
 
 #include "i3lock.h"
 #include "xcb.h"
 #include "cursors.h"
 #include "unlock_indicator.h"
 #include "randr.h"
+#include "dpms.h"
 #include "dpi.h"
+#include "auth.h"
+#include "stats.h"
+#include "secmem.h"
+#include "keytable.h"
+#include "display.h"
+#include "control.h"
+#ifdef I3LOCK_LOGIND
+#include "logind.h"
+#endif
 
 #define TSTAMP_N_SECS(n) (n * 1.0)
 #define TSTAMP_N_MINS(n) (60 * TSTAMP_N_SECS(n))
-#define START_TIMER(timer_obj, timeout, callback) \
-    timer_obj = start_timer(timer_obj, timeout, callback)
-#define STOP_TIMER(timer_obj) \
-    timer_obj = stop_timer(timer_obj)
 
-typedef void (*ev_callback_t)(EV_P_ ev_timer *w, int revents);
+/* Keymap changes (e.g. by setxkbmap or a hotplugged keyboard) arrive in
+ * bursts of notifications, which are coalesced into one reload. */
+#define KEYMAP_RELOAD_DELAY TSTAMP_N_SECS(0.05)
+
+/* In daemon mode, a failed grab is retried from the main loop, after a delay
+ * which doubles up to GRAB_RETRY_MAX. Like in grab_display(), the focus is
+ * stolen after GRAB_STEAL_FOCUS, and locking fails after GRAB_TIMEOUT. */
+#define GRAB_RETRY_MIN TSTAMP_N_SECS(0.001)
+#define GRAB_RETRY_MAX TSTAMP_N_SECS(0.032)
+#define GRAB_STEAL_FOCUS TSTAMP_N_SECS(0.1)
+#define GRAB_TIMEOUT TSTAMP_N_SECS(1.1)
+
+/* While a display is off, how often to check whether it woke up without any
+ * input reaching us, e.g. because another client reset the DPMS timeout. */
+#define DISPLAY_OFF_POLL TSTAMP_N_SECS(1)
+
+/* The timers of the main loop. Each one exists exactly once, so that
+ * restarting a timer just moves it and never allocates. */
+typedef enum {
+    TIMER_CLEAR_AUTH_WRONG = 0,
+    TIMER_CLEAR_INDICATOR,
+    TIMER_DISCARD_PASSWD,
+    TIMER_REDRAW,
+    TIMER_AUTH_TIMEOUT,
+    TIMER_RELOAD_KEYMAP,
+    TIMER_GRAB,
+    TIMER_LOCK_FAILED,
+    TIMER_DISPLAY_OFF_POLL,
+    TIMER_COUNT,
+} timer_id_t;
 static void input_done(void);
+static void auth_done(const auth_result_t *result);
+static void finish_unlock(void);
 
 char color[7] = "a3a3a3";
 uint32_t last_resolution[2];
 xcb_window_t win;
-static xcb_cursor_t cursor;
-#ifndef __OpenBSD__
-static pam_handle_t *pam_handle;
-static bool pam_cleanup;
-#endif
+xcb_cursor_t cursor;
 int input_position = 0;
-/* Holds the password you enter (in UTF-8). */
-static char password[512];
+/* Holds the password you enter (in UTF-8), and the UTF-8 of one key press.
+ * Both are allocated from the secure arena (see secmem.c). */
+#define PASSWORD_SIZE 512
+#define KEY_BUFFER_SIZE 128
+static char *password;
+static char *key_buffer;
 static bool beep = false;
 bool debug_mode = false;
 bool unlock_indicator = true;
 bool clock_visible = true;
+static struct ev_periodic clock_update;
+
 char *modifier_string = NULL;
 static bool dont_fork = false;
+/* With --daemon, i3lock stays running between locks, see lock_now(). */
+static bool daemon_mode = false;
+static bool locked = false;
+/* While lock_now() grabs: the display which is grabbed next, -1 otherwise. */
+static int grab_next = -1;
+static int grab_attempts;
+static ev_tstamp grab_started;
+static ev_tstamp grab_delay;
+static bool grab_focus_stolen;
+static uint64_t lock_started;
 struct ev_loop *main_loop;
-static struct ev_timer *clear_auth_wrong_timeout;
-static struct ev_timer *clear_indicator_timeout;
-static struct ev_timer *discard_passwd_timeout;
+static struct ev_timer timers[TIMER_COUNT];
+/* Seconds after which an authentication attempt is abandoned, 0 = never. */
+static double auth_timeout = 0;
+/* The PAM services to authenticate against, see --pam-service. */
+static const char *pam_services[AUTH_MAX_SERVICES];
+static int num_pam_services = 0;
 extern unlock_state_t unlock_state;
 extern auth_state_t auth_state;
 int failed_attempts = 0;
 bool show_failed_attempts = false;
 bool retry_verification = false;
 
-static struct xkb_state *xkb_state;
+/* While xcb_check_cb() handles a batch of X11 events, redraws are deferred
+ * until the batch is done, so that a burst of key presses costs one frame. */
+static bool in_event_batch = false;
+static bool redraw_deferred = false;
+static int batched_key_presses = 0;
+
+/* When i3lock read the first key press which is not drawn yet. After drawing
+ * it, a GetInputFocus round trip tells us when the X server is done with the
+ * frame (frame_sequence, 0 when no measurement is in flight). */
+static uint64_t key_received_us = 0;
+static lock_display_t *key_display = NULL;
+static unsigned int frame_sequence = 0;
+static lock_display_t *frame_display = NULL;
+static uint64_t frame_key_received_us = 0;
+
 static struct xkb_context *xkb_context;
-static struct xkb_keymap *xkb_keymap;
+/* The display the password is typed on, whose modifiers auth_done() shows. */
+static lock_display_t *input_display = NULL;
 static struct xkb_compose_table *xkb_compose_table;
 static struct xkb_compose_state *xkb_compose_state;
-static uint8_t xkb_base_event;
-static uint8_t xkb_base_error;
-static int randr_base = -1;
+
+/* The compose table is loaded on a thread once the window is mapped (see
+ * start_compose_loading()). Until it is ready, key presses which might start a
+ * compose sequence, and all key presses after them, are kept back. */
+typedef enum {
+    COMPOSE_NOT_LOADED = 0,
+    COMPOSE_LOADING,
+    COMPOSE_DONE, /* loaded, or failed to load */
+} compose_loading_t;
+static compose_loading_t compose_loading = COMPOSE_NOT_LOADED;
+static const char *compose_locale;
+static pthread_t compose_thread;
+static struct ev_async compose_ready;
+/* Written by the loading thread, read after joining it. */
+static struct xkb_compose_table *compose_thread_result;
+
+/* Held back keys are password-derived, so they live in the secure arena. */
+#define MAX_HELD_KEYS 64
+static struct held_key {
+    xkb_keysym_t ksym;
+    bool ctrl;
+} *held_keys;
+static int num_held_keys = 0;
 
 cairo_surface_t *img = NULL;
 bool tile = false;
+/* In daemon mode, the image is decoded again when its file changed. */
+static const char *image_file;
+static const char *image_file_format;
+static struct ev_stat image_watcher;
+static bool image_stale = false;
 bool ignore_empty_password = false;
 bool skip_repeated_empty_password = false;
 
@@ -112,10 +201,10 @@ static void u8_dec(char *s, int *i) {
 /*
  * Loads the XKB keymap from the X11 server and feeds it to xkbcommon.
  * Necessary so that we can properly let xkbcommon track the keyboard state and
- * translate keypresses to utf-8.
+ * translate keypresses to utf-8. The display must be selected.
  *
  */
-static bool load_keymap(void) {
+static bool load_keymap(lock_display_t *d) {
     if (xkb_context == NULL) {
         if ((xkb_context = xkb_context_new(0)) == NULL) {
             fprintf(stderr, "[i3lock] could not create xkbcommon context\n");
@@ -123,36 +212,46 @@ static bool load_keymap(void) {
         }
     }
 
-    xkb_keymap_unref(xkb_keymap);
+    xkb_keymap_unref(d->xkb_keymap);
 
-    int32_t device_id = xkb_x11_get_core_keyboard_device_id(conn);
+    /* The core keyboard is known when connecting, see connect_display(). */
+    int32_t device_id = d->xkb_device_id;
+    if (device_id == -1) {
+        device_id = xkb_x11_get_core_keyboard_device_id(conn);
+        round_trips++;
+    }
     DEBUG("device = %d\n", device_id);
-    if ((xkb_keymap = xkb_x11_keymap_new_from_device(xkb_context, conn, device_id, 0)) == NULL) {
+    /* xkbcommon needs several round trips itself, which are counted as one. */
+    round_trips++;
+    if ((d->xkb_keymap = xkb_x11_keymap_new_from_device(xkb_context, conn, device_id, 0)) == NULL) {
         fprintf(stderr, "[i3lock] xkb_x11_keymap_new_from_device failed\n");
         return false;
     }
 
     struct xkb_state *new_state =
-        xkb_x11_state_new_from_device(xkb_keymap, conn, device_id);
+        xkb_x11_state_new_from_device(d->xkb_keymap, conn, device_id);
     if (new_state == NULL) {
         fprintf(stderr, "[i3lock] xkb_x11_state_new_from_device failed\n");
         return false;
     }
 
-    xkb_state_unref(xkb_state);
-    xkb_state = new_state;
+    xkb_state_unref(d->xkb_state);
+    d->xkb_state = new_state;
+    d->xkb_device_id = device_id;
+
+    d->keytable = keytable_build(d->keytable, d->xkb_keymap, xkb_compose_table);
 
     return true;
 }
 
 /*
- * Loads the XKB compose table from the given locale.
+ * Starts using the given XKB compose table.
  *
  */
-static bool load_compose_table(const char *locale) {
+static bool install_compose_table(struct xkb_compose_table *table) {
     xkb_compose_table_unref(xkb_compose_table);
 
-    if ((xkb_compose_table = xkb_compose_table_new_from_locale(xkb_context, locale, 0)) == NULL) {
+    if ((xkb_compose_table = table) == NULL) {
         fprintf(stderr, "[i3lock] xkb_compose_table_new_from_locale failed\n");
         return false;
     }
@@ -166,6 +265,12 @@ static bool load_compose_table(const char *locale) {
     xkb_compose_state_unref(xkb_compose_state);
     xkb_compose_state = new_compose_state;
 
+    /* The compose table is shared, the key tables belong to the displays. */
+    for (int i = 0; i < num_displays; i++) {
+        lock_display_t *d = &displays[i];
+        d->keytable = keytable_build(d->keytable, d->xkb_keymap, xkb_compose_table);
+    }
+
     return true;
 }
 
@@ -175,46 +280,28 @@ static bool load_compose_table(const char *locale) {
  *
  */
 static void clear_password_memory(void) {
-#ifdef HAVE_EXPLICIT_BZERO
-    /* Use explicit_bzero(3) which was explicitly designed not to be
-     * optimized out by the compiler. */
-    explicit_bzero(password, strlen(password));
-#else
-    /* A volatile pointer to the password buffer to prevent the compiler from
-     * optimizing this out. */
-    volatile char *vpassword = password;
-    for (size_t c = 0; c < sizeof(password); c++)
-        /* We store a non-random pattern which consists of the (irrelevant)
-         * index plus (!) the value of the beep variable. This prevents the
-         * compiler from optimizing the calls away, since the value of 'beep'
-         * is not known at compile-time. */
-        vpassword[c] = c + (int)beep;
-#endif
+    secmem_clear(password, PASSWORD_SIZE);
 }
 
-ev_timer *start_timer(ev_timer *timer_obj, ev_tstamp timeout, ev_callback_t callback) {
-    if (timer_obj) {
-        ev_timer_stop(main_loop, timer_obj);
-        ev_timer_set(timer_obj, timeout, 0.);
-        ev_timer_start(main_loop, timer_obj);
-    } else {
-        /* When there is no memory, we just don’t have a timeout. We cannot
-         * exit() here, since that would effectively unlock the screen. */
-        timer_obj = calloc(sizeof(struct ev_timer), 1);
-        if (timer_obj) {
-            ev_timer_init(timer_obj, callback, timeout, 0.);
-            ev_timer_start(main_loop, timer_obj);
-        }
-    }
-    return timer_obj;
+static void request_redraw(void) {
+    if (in_event_batch)
+        redraw_deferred = true;
+    else
+        redraw_screen();
 }
 
-ev_timer *stop_timer(ev_timer *timer_obj) {
-    if (timer_obj) {
-        ev_timer_stop(main_loop, timer_obj);
-        free(timer_obj);
-    }
-    return NULL;
+/*
+ * (Re)starts the given timer to fire after timeout seconds. ev_timer_again()
+ * makes the timer repeat, so every callback stops its timer.
+ *
+ */
+static void start_timer(timer_id_t id, ev_tstamp timeout) {
+    timers[id].repeat = timeout;
+    ev_timer_again(main_loop, &timers[id]);
+}
+
+static void stop_timer(timer_id_t id) {
+    ev_timer_stop(main_loop, &timers[id]);
 }
 
 /*
@@ -222,9 +309,10 @@ ev_timer *stop_timer(ev_timer *timer_obj) {
  *
  */
 static void finish_input(void) {
+    stats_auth_mark(AUTH_PHASE_KEY_ENTER);
     password[input_position] = '\0';
     unlock_state = STATE_KEY_PRESSED;
-    redraw_screen();
+    request_redraw();
     input_done();
 }
 
@@ -236,6 +324,7 @@ static void finish_input(void) {
 static void clear_auth_wrong(EV_P_ ev_timer *w, int revents) {
     DEBUG("clearing auth wrong\n");
     auth_state = STATE_AUTH_IDLE;
+    control_set_state(CONTROL_LOCKED);
     redraw_screen();
 
     /* Clear modifier string. */
@@ -245,7 +334,7 @@ static void clear_auth_wrong(EV_P_ ev_timer *w, int revents) {
     }
 
     /* Now free this timeout. */
-    STOP_TIMER(clear_auth_wrong_timeout);
+    stop_timer(TIMER_CLEAR_AUTH_WRONG);
 
     /* retry with input done during auth verification */
     if (retry_verification) {
@@ -256,7 +345,7 @@ static void clear_auth_wrong(EV_P_ ev_timer *w, int revents) {
 
 static void clear_indicator_cb(EV_P_ ev_timer *w, int revents) {
     clear_indicator();
-    STOP_TIMER(clear_indicator_timeout);
+    stop_timer(TIMER_CLEAR_INDICATOR);
 }
 
 static void clear_input(void) {
@@ -267,64 +356,201 @@ static void clear_input(void) {
 
 static void discard_passwd_cb(EV_P_ ev_timer *w, int revents) {
     clear_input();
-    STOP_TIMER(discard_passwd_timeout);
+    stop_timer(TIMER_DISCARD_PASSWD);
+}
+
+/*
+ * Called when the display gets blanked or wakes up again. While it is off,
+ * the clock does not tick and nothing is redrawn. DPMS does not tell us when
+ * the display wakes up. Input does, so the pointer grab reports motion and
+ * button presses meanwhile, and display_off_poll_cb() catches the rest.
+ *
+ */
+static bool all_displays_off(void) {
+    for (int i = 0; i < num_displays; i++) {
+        if (!displays[i].broken && !displays[i].display_off)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Starts the minute tick of the clock. In daemon mode, it only ticks while
+ * locked, the frame is brought up to date when locking.
+ *
+ */
+static void start_clock(void) {
+    if (clock_visible && (locked || !daemon_mode) && !ev_is_active(&clock_update))
+        ev_periodic_start(main_loop, &clock_update);
+}
+
+/*
+ * The X server blanks all of its screens at once, so this applies to every
+ * screen of the given display.
+ *
+ */
+static void set_display_off(lock_display_t *d, bool off) {
+    lock_display_t *owner = d->owner;
+    if (owner->display_off == off)
+        return;
+
+    if (off)
+        DEBUG("display is off, pausing redraws\n");
+    else
+        DEBUG("display is on again, skipped %d redraws\n", owner->skipped_redraws);
+    for (int i = 0; i < num_displays; i++) {
+        if (displays[i].owner != owner)
+            continue;
+        displays[i].display_off = off;
+        displays[i].skipped_redraws = 0;
+    }
+
+    lock_display_t *prev = current_display;
+    display_select(owner);
+    xcb_change_active_pointer_grab(conn, cursor, XCB_CURRENT_TIME,
+                                   off ? XCB_EVENT_MASK_POINTER_MOTION | XCB_EVENT_MASK_BUTTON_PRESS : XCB_NONE);
+    xcb_flush(conn);
+    display_select(prev);
+
+    if (off) {
+        if (clock_visible && all_displays_off())
+            ev_periodic_stop(main_loop, &clock_update);
+        if (!ev_is_active(&timers[TIMER_DISPLAY_OFF_POLL]))
+            start_timer(TIMER_DISPLAY_OFF_POLL, DISPLAY_OFF_POLL);
+        return;
+    }
+
+    start_clock();
+    /* One frame to catch up on everything which was skipped. */
+    request_redraw();
+}
+
+/*
+ * Wakes the displays which are on again although no input told us so, which
+ * draws the frame that was skipped meanwhile. Runs while any display is off.
+ *
+ */
+static void display_off_poll_cb(EV_P_ ev_timer *w, int revents) {
+    lock_display_t *prev = current_display;
+    bool any_off = false;
+
+    for (int i = 0; i < num_displays; i++) {
+        lock_display_t *d = &displays[i];
+        if (d->broken || d->owner != d || !d->display_off)
+            continue;
+        display_select(d);
+        if (dpms_display_off(d->screensaver_base))
+            any_off = true;
+        else
+            set_display_off(d, false);
+    }
+    display_select(prev);
+
+    if (!any_off)
+        stop_timer(TIMER_DISPLAY_OFF_POLL);
 }
 
 static void clock_minute_cb(EV_P_ ev_periodic *p, int revents) {
+    lock_display_t *prev = current_display;
+    for (int i = 0; i < num_displays; i++) {
+        lock_display_t *d = &displays[i];
+        if (d->broken || d->owner != d)
+            continue;
+        display_select(d);
+        if (dpms_display_off(d->screensaver_base))
+            set_display_off(d, true);
+    }
+    display_select(prev);
     redraw_screen();
 }
 
+static void dump_stats_cb(EV_P_ ev_signal *w, int revents) {
+    stats_print();
+}
+
+/*
+ * Abandons the authentication attempt in flight and shows the given state
+ * instead of “verifying”.
+ *
+ */
+static void cancel_auth(auth_state_t new_state) {
+    stop_timer(TIMER_AUTH_TIMEOUT);
+    auth_cancel();
+
+    auth_state = new_state;
+    control_set_state(CONTROL_LOCKED);
+    request_redraw();
+}
+
+/*
+ * Abandons an authentication attempt which took longer than --auth-timeout
+ * (e.g. because a network-backed PAM module hangs), so that the user can
+ * retry right away.
+ *
+ */
+static void auth_timeout_cb(EV_P_ ev_timer *w, int revents) {
+    DEBUG("authentication timed out after %.1f s\n", auth_timeout);
+    cancel_auth(STATE_AUTH_TIMEOUT);
+    start_timer(TIMER_CLEAR_AUTH_WRONG, TSTAMP_N_SECS(2));
+}
+
 static void input_done(void) {
-    STOP_TIMER(clear_auth_wrong_timeout);
+    stop_timer(TIMER_CLEAR_AUTH_WRONG);
     auth_state = STATE_AUTH_VERIFY;
     unlock_state = STATE_STARTED;
-    redraw_screen();
+    control_set_state(CONTROL_VERIFYING);
+    request_redraw();
 
-#ifdef __OpenBSD__
-    struct passwd *pw;
-
-    if (!(pw = getpwuid(getuid())))
-        errx(1, "unknown uid %u.", getuid());
+    if (auth_timeout > 0)
+        start_timer(TIMER_AUTH_TIMEOUT, auth_timeout);
 
-    if (auth_userokay(pw->pw_name, NULL, NULL, password) != 0) {
-        DEBUG("successfully authenticated\n");
-        clear_password_memory();
-
-        ev_break(EV_DEFAULT, EVBREAK_ALL);
-        return;
+    /* The authentication helper works on its own copy of the password, so the
+     * input buffer can already take the next password (typed while this one
+     * is being verified). */
+    bool started = auth_start(password);
+    clear_input();
+    if (!started) {
+        auth_result_t result = {.success = false};
+        auth_done(&result);
     }
-#else
-    if (pam_authenticate(pam_handle, 0) == PAM_SUCCESS) {
-        DEBUG("successfully authenticated\n");
-        clear_password_memory();
+}
+
+/*
+ * Called once the authentication helper verified the password which was
+ * handed over in input_done().
+ *
+ */
+static void auth_done(const auth_result_t *result) {
+    stop_timer(TIMER_AUTH_TIMEOUT);
 
-        /* PAM credentials should be refreshed, this will for example update any kerberos tickets.
-         * Related to credentials pam_end() needs to be called to cleanup any temporary
-         * credentials like kerberos /tmp/krb5cc_pam_* files which may of been left behind if the
-         * refresh of the credentials failed. */
-        pam_setcred(pam_handle, PAM_REFRESH_CRED);
-        pam_cleanup = true;
+    for (int i = 0; i < result->num_messages; i++)
+        DEBUG("authentication backend: %s\n", result->messages[i]);
 
-        ev_break(EV_DEFAULT, EVBREAK_ALL);
+    if (result->success) {
+        if (daemon_mode)
+            finish_unlock();
+        else
+            ev_break(EV_DEFAULT, EVBREAK_ALL);
         return;
     }
-#endif
 
     if (debug_mode)
         fprintf(stderr, "Authentication failure\n");
+    stats_auth_commit();
 
     /* Get state of Caps and Num lock modifiers, to be displayed in
      * STATE_AUTH_WRONG state */
     xkb_mod_index_t idx, num_mods;
     const char *mod_name;
+    lock_display_t *d = input_display;
 
-    num_mods = xkb_keymap_num_mods(xkb_keymap);
+    num_mods = (d != NULL && d->xkb_keymap != NULL ? xkb_keymap_num_mods(d->xkb_keymap) : 0);
 
     for (idx = 0; idx < num_mods; idx++) {
-        if (!xkb_state_mod_index_is_active(xkb_state, idx, XKB_STATE_MODS_EFFECTIVE))
+        if (!xkb_state_mod_index_is_active(d->xkb_state, idx, XKB_STATE_MODS_EFFECTIVE))
             continue;
 
-        mod_name = xkb_keymap_mod_get_name(xkb_keymap, idx);
+        mod_name = xkb_keymap_mod_get_name(d->xkb_keymap, idx);
         if (mod_name == NULL)
             continue;
 
@@ -350,18 +576,18 @@ static void input_done(void) {
 
     auth_state = STATE_AUTH_WRONG;
     failed_attempts += 1;
-    clear_input();
+    control_set_state(CONTROL_WRONG);
     if (unlock_indicator)
         redraw_screen();
 
     /* Clear this state after 2 seconds (unless the user enters another
      * password during that time). */
     ev_now_update(main_loop);
-    START_TIMER(clear_auth_wrong_timeout, TSTAMP_N_SECS(2), clear_auth_wrong);
+    start_timer(TIMER_CLEAR_AUTH_WRONG, TSTAMP_N_SECS(2));
 
     /* Cancel the clear_indicator_timeout, it would hide the unlock indicator
      * too early. */
-    STOP_TIMER(clear_indicator_timeout);
+    stop_timer(TIMER_CLEAR_INDICATOR);
 
     /* beep on authentication failure, if enabled */
     if (beep) {
@@ -372,7 +598,7 @@ static void input_done(void) {
 
 static void redraw_timeout(EV_P_ ev_timer *w, int revents) {
     redraw_screen();
-    STOP_TIMER(w);
+    stop_timer(TIMER_REDRAW);
 }
 
 static bool skip_without_validation(void) {
@@ -385,24 +611,124 @@ static bool skip_without_validation(void) {
     return false;
 }
 
+static void apply_key(const char *text, int n, key_action_t action);
+static void handle_keysym(xkb_keysym_t ksym, bool ctrl);
+static void finish_event_batch(void);
+
+static void *compose_thread_main(void *arg) {
+    /* xkbcommon contexts must not be shared between threads. */
+    struct xkb_context *context = xkb_context_new(0);
+    if (context != NULL) {
+        compose_thread_result = xkb_compose_table_new_from_locale(context, compose_locale, 0);
+        xkb_context_unref(context);
+    }
+    ev_async_send(main_loop, &compose_ready);
+    return NULL;
+}
+
 /*
- * Handle key presses. Fixes state, then looks up the key symbol for the
- * given keycode, then looks up the key symbol (as UCS-2), converts it to
- * UTF-8 and stores it in the password array.
+ * Waits for the loading thread, starts using the compose table and handles
+ * the keys which were held back in the meantime.
  *
  */
-static void handle_key_press(xcb_key_press_event_t *event) {
-    xkb_keysym_t ksym;
-    char buffer[128];
-    int n;
-    bool ctrl;
+static void finish_compose_loading(void) {
+    if (compose_loading != COMPOSE_LOADING)
+        return;
+
+    pthread_join(compose_thread, NULL);
+    ev_async_stop(main_loop, &compose_ready);
+    compose_loading = COMPOSE_DONE;
+    DEBUG("loaded the compose table for locale %s\n", compose_locale);
+    (void)install_compose_table(compose_thread_result);
+    compose_thread_result = NULL;
+
+    bool batch = in_event_batch;
+    in_event_batch = true;
+    for (int i = 0; i < num_held_keys; i++)
+        handle_keysym(held_keys[i].ksym, held_keys[i].ctrl);
+    secmem_clear(held_keys, MAX_HELD_KEYS * sizeof(struct held_key));
+    num_held_keys = 0;
+    if (!batch)
+        finish_event_batch();
+}
+
+static void compose_ready_cb(EV_P_ ev_async *w, int revents) {
+    finish_compose_loading();
+}
+
+/*
+ * Parses the compose table (the locale’s Compose file, thousands of lines) on
+ * a thread, so that it does not delay locking. Called once the window is
+ * mapped, i.e. after the fork() on the first MapNotify, which the thread would
+ * not survive.
+ *
+ */
+static void start_compose_loading(void) {
+    if (compose_loading != COMPOSE_NOT_LOADED)
+        return;
+
+    ev_async_init(&compose_ready, compose_ready_cb);
+    ev_async_start(main_loop, &compose_ready);
+    if (pthread_create(&compose_thread, NULL, compose_thread_main, NULL) == 0) {
+        compose_loading = COMPOSE_LOADING;
+        return;
+    }
+
+    /* Without a thread, load the table right away. */
+    ev_async_stop(main_loop, &compose_ready);
+    compose_loading = COMPOSE_DONE;
+    (void)install_compose_table(xkb_compose_table_new_from_locale(xkb_context, compose_locale, 0));
+}
+
+/*
+ * Keeps a key press until the compose table is loaded. When too many keys are
+ * held back, this waits for the loading thread.
+ *
+ */
+static void hold_key(xkb_keysym_t ksym, bool ctrl) {
+    start_compose_loading();
+    if (num_held_keys == MAX_HELD_KEYS)
+        finish_compose_loading();
+
+    if (compose_loading == COMPOSE_DONE) {
+        handle_keysym(ksym, ctrl);
+        return;
+    }
+
+    DEBUG("holding back a key until the compose table is loaded\n");
+    held_keys[num_held_keys].ksym = ksym;
+    held_keys[num_held_keys].ctrl = ctrl;
+    num_held_keys++;
+}
+
+/*
+ * Whether a compose sequence might start with the given keysym: dead keys and
+ * the Multi_key.
+ *
+ */
+static bool maybe_compose_start(xkb_keysym_t ksym) {
+    return ((ksym >= XKB_KEY_dead_grave && ksym <= 0xfeff) || ksym == XKB_KEY_Multi_key);
+}
+
+/*
+ * Handles a key press given as key symbol: Feeds it to the compose state
+ * machine and converts the result to UTF-8.
+ *
+ */
+static void handle_keysym(xkb_keysym_t ksym, bool ctrl) {
+    char *buffer = key_buffer;
     bool composed = false;
+    int n;
 
-    ksym = xkb_state_key_get_one_sym(xkb_state, event->detail);
-    ctrl = xkb_state_mod_name_is_active(xkb_state, XKB_MOD_NAME_CTRL, XKB_STATE_MODS_DEPRESSED);
+    /* Hold the key back while the compose table is not ready. */
+    if (compose_loading != COMPOSE_DONE &&
+        (num_held_keys > 0 || maybe_compose_start(ksym))) {
+        hold_key(ksym, ctrl);
+        return;
+    }
 
     /* The buffer will be null-terminated, so n >= 2 for 1 actual character. */
-    memset(buffer, '\0', sizeof(buffer));
+    secmem_clear(buffer, KEY_BUFFER_SIZE);
 
     if (xkb_compose_state && xkb_compose_state_feed(xkb_compose_state, ksym) == XKB_COMPOSE_FEED_ACCEPTED) {
         switch (xkb_compose_state_get_status(xkb_compose_state)) {
@@ -412,8 +738,8 @@ static void handle_key_press(xcb_key_press_event_t *event) {
                 return;
             case XKB_COMPOSE_COMPOSED:
                 /* xkb_compose_state_get_utf8 doesn't include the terminating byte in the return value
-             * as xkb_keysym_to_utf8 does. Adding one makes the variable n consistent. */
-                n = xkb_compose_state_get_utf8(xkb_compose_state, buffer, sizeof(buffer)) + 1;
+                 * as xkb_keysym_to_utf8 does. Adding one makes the variable n consistent. */
+                n = xkb_compose_state_get_utf8(xkb_compose_state, buffer, KEY_BUFFER_SIZE) + 1;
                 ksym = xkb_compose_state_get_one_sym(xkb_compose_state);
                 composed = true;
                 break;
@@ -424,17 +750,51 @@ static void handle_key_press(xcb_key_press_event_t *event) {
     }
 
     if (!composed) {
-        n = xkb_keysym_to_utf8(ksym, buffer, sizeof(buffer));
+        n = xkb_keysym_to_utf8(ksym, buffer, KEY_BUFFER_SIZE);
     }
 
-    switch (ksym) {
-        case XKB_KEY_j:
-        case XKB_KEY_m:
-        case XKB_KEY_Return:
-        case XKB_KEY_KP_Enter:
-        case XKB_KEY_XF86ScreenSaver:
-            if ((ksym == XKB_KEY_j || ksym == XKB_KEY_m) && !ctrl)
-                break;
+    apply_key(buffer, n, keytable_action(ksym, ctrl, n));
+}
+
+/*
+ * Handle key presses. Looks up what the key does in the key table (see
+ * keytable.c). Keys which might take part in a compose sequence take the slow
+ * path through handle_keysym().
+ *
+ */
+static void handle_key_press(lock_display_t *d, xcb_key_press_event_t *event) {
+    const key_entry_t *key = NULL;
+    bool ctrl = keytable_ctrl_active(d->keytable, d->xkb_state);
+
+    input_display = d;
+
+    if (num_held_keys == 0 &&
+        (xkb_compose_state == NULL ||
+         xkb_compose_state_get_status(xkb_compose_state) != XKB_COMPOSE_COMPOSING))
+        key = keytable_lookup(d->keytable, d->xkb_state, event->detail);
+
+    if (key != NULL && !key->compose_start &&
+        (compose_loading == COMPOSE_DONE || !maybe_compose_start(key->keysym))) {
+        /* n includes the terminating byte, like xkb_keysym_to_utf8 */
+        apply_key(key->utf8, key->utf8_len + 1, (ctrl ? key->ctrl_action : key->action));
+        return;
+    }
+
+    handle_keysym(xkb_state_key_get_one_sym(d->xkb_state, event->detail), ctrl);
+}
+
+/*
+ * Acts on a key press: text is its UTF-8 and n the size of it including the
+ * terminating byte. Text is stored in the password array.
+ *
+ */
+static void apply_key(const char *text, int n, key_action_t action) {
+    switch (action) {
+        case KEY_SUBMIT:
+            /* The attempt in flight is cancelled as soon as a new password
+             * is typed, so there is nothing to verify yet. */
+            if (auth_state == STATE_AUTH_VERIFY)
+                return;
 
             if (auth_state == STATE_AUTH_WRONG) {
                 retry_verification = true;
@@ -458,37 +818,23 @@ static void handle_key_press(xcb_key_press_event_t *event) {
             }
     }
 
-    switch (ksym) {
-        case XKB_KEY_u:
-        case XKB_KEY_Escape:
-            if ((ksym == XKB_KEY_u && ctrl) ||
-                ksym == XKB_KEY_Escape) {
-                DEBUG("C-u pressed\n");
-                clear_input();
-                /* Also hide the unlock indicator */
-                if (unlock_indicator)
-                    clear_indicator();
-                return;
-            }
-            break;
-
-        case XKB_KEY_Delete:
-        case XKB_KEY_KP_Delete:
-            /* Deleting forward doesn’t make sense, as i3lock doesn’t allow you
-             * to move the cursor when entering a password. We need to eat this
-             * key press so that it won’t be treated as part of the password,
-             * see issue #50. */
+    switch (action) {
+        case KEY_CLEAR:
+            DEBUG("C-u pressed\n");
+            clear_input();
+            /* Also hide the unlock indicator */
+            if (unlock_indicator)
+                clear_indicator();
             return;
 
-        case XKB_KEY_h:
-        case XKB_KEY_BackSpace:
-            if (ksym == XKB_KEY_h && !ctrl)
-                break;
+        case KEY_IGNORE:
+            return;
 
+        case KEY_BACKSPACE:
             if (input_position == 0) {
-                START_TIMER(clear_indicator_timeout, 1.0, clear_indicator_cb);
+                start_timer(TIMER_CLEAR_INDICATOR, 1.0);
                 unlock_state = STATE_NOTHING_TO_DELETE;
-                redraw_screen();
+                request_redraw();
                 return;
             }
 
@@ -498,14 +844,17 @@ static void handle_key_press(xcb_key_press_event_t *event) {
 
             /* Hide the unlock indicator after a bit if the password buffer is
              * empty. */
-            START_TIMER(clear_indicator_timeout, 1.0, clear_indicator_cb);
+            start_timer(TIMER_CLEAR_INDICATOR, 1.0);
             unlock_state = STATE_BACKSPACE_ACTIVE;
-            redraw_screen();
-            unlock_state = STATE_KEY_PRESSED;
+            request_redraw();
             return;
+
+        default:
+            break;
     }
 
-    if ((input_position + 8) >= (int)sizeof(password))
+    if ((input_position + 8) >= PASSWORD_SIZE ||
+        (input_position + n) >= PASSWORD_SIZE)
         return;
 
 #if 0
@@ -519,25 +868,24 @@ static void handle_key_press(xcb_key_press_event_t *event) {
     printf("xcb_is_modifier_key = %d\n", xcb_is_modifier_key(sym));
 #endif
 
-    if (n < 2)
-        return;
+    /* Typing a new password cancels the attempt in flight. */
+    if (auth_state == STATE_AUTH_VERIFY) {
+        DEBUG("new input, cancelling the pending authentication\n");
+        cancel_auth(STATE_AUTH_IDLE);
+    }
 
     /* store it in the password array as UTF-8 */
-    memcpy(password + input_position, buffer, n - 1);
+    memcpy(password + input_position, text, n - 1);
     input_position += n - 1;
     DEBUG("current password = %.*s\n", input_position, password);
 
     if (unlock_indicator) {
         unlock_state = STATE_KEY_ACTIVE;
-        redraw_screen();
-        unlock_state = STATE_KEY_PRESSED;
-
-        struct ev_timer *timeout = NULL;
-        START_TIMER(timeout, TSTAMP_N_SECS(0.25), redraw_timeout);
-        STOP_TIMER(clear_indicator_timeout);
+        request_redraw();
+        stop_timer(TIMER_CLEAR_INDICATOR);
     }
 
-    START_TIMER(discard_passwd_timeout, TSTAMP_N_MINS(3), discard_passwd_cb);
+    start_timer(TIMER_DISCARD_PASSWD, TSTAMP_N_MINS(3));
 }
 
 /*
@@ -558,6 +906,127 @@ static void handle_visibility_notify(xcb_connection_t *conn,
     }
 }
 
+/*
+ * What a raise watcher thread watches, see raise_thread_main().
+ *
+ */
+typedef struct raise_watcher {
+    char *display_name;
+    xcb_window_t window;
+} raise_watcher_t;
+
+/* Whether the raise watchers for the current lock were started. */
+static bool raise_watchers_started = false;
+
+/*
+ * Raises the given lock window when it is obscured, even when the main loop is
+ * busy, using a connection of its own. Returns once the window is unmapped.
+ *
+ */
+static void raise_loop(const char *display_name, xcb_window_t window) {
+    xcb_connection_t *conn;
+    xcb_generic_event_t *event;
+    int screens;
+
+    if (xcb_connection_has_error((conn = xcb_connect(display_name, &screens))) > 0) {
+        fprintf(stderr, "[i3lock] raise watcher: cannot open display\n");
+        xcb_disconnect(conn);
+        return;
+    }
+
+    /* We need to know about the window being obscured or getting destroyed. */
+    xcb_change_window_attributes(conn, window, XCB_CW_EVENT_MASK,
+                                 (uint32_t[]){
+                                     XCB_EVENT_MASK_VISIBILITY_CHANGE |
+                                     XCB_EVENT_MASK_STRUCTURE_NOTIFY});
+
+    /* In daemon mode, the window might have been unmapped again before the
+     * events were selected. */
+    xcb_get_window_attributes_reply_t *attributes =
+        xcb_get_window_attributes_reply(conn, xcb_get_window_attributes(conn, window), NULL);
+    bool done = (attributes == NULL || attributes->map_state == XCB_MAP_STATE_UNMAPPED);
+    free(attributes);
+
+    DEBUG("Watching window 0x%08x\n", window);
+    while (!done && (event = xcb_wait_for_event(conn)) != NULL) {
+        if (event->response_type == 0) {
+            xcb_generic_error_t *error = (xcb_generic_error_t *)event;
+            DEBUG("X11 Error received! sequence 0x%x, error_code = %d\n",
+                  error->sequence, error->error_code);
+            /* The window is gone already. */
+            done = (error->error_code == XCB_WINDOW);
+            free(event);
+            continue;
+        }
+        /* Strip off the highest bit (set if the event is generated) */
+        int type = (event->response_type & 0x7F);
+        DEBUG("Read event of type %d\n", type);
+        switch (type) {
+            case XCB_VISIBILITY_NOTIFY:
+                handle_visibility_notify(conn, (xcb_visibility_notify_event_t *)event);
+                break;
+            case XCB_UNMAP_NOTIFY:
+                DEBUG("UnmapNotify for 0x%08x\n", (((xcb_unmap_notify_event_t *)event)->window));
+                done = (((xcb_unmap_notify_event_t *)event)->window == window);
+                break;
+            case XCB_DESTROY_NOTIFY:
+                DEBUG("DestroyNotify for 0x%08x\n", (((xcb_destroy_notify_event_t *)event)->window));
+                done = (((xcb_destroy_notify_event_t *)event)->window == window);
+                break;
+            default:
+                DEBUG("Unhandled event type %d\n", type);
+                break;
+        }
+        free(event);
+    }
+    xcb_disconnect(conn);
+}
+
+static void *raise_thread_main(void *arg) {
+    raise_watcher_t *watcher = arg;
+
+    raise_loop(watcher->display_name, watcher->window);
+    free(watcher->display_name);
+    free(watcher);
+    return NULL;
+}
+
+/*
+ * Starts a thread for every lock window, which raises the window whenever it
+ * gets obscured (see raise_loop()) and exits once it is unmapped. Called
+ * once the windows are mapped, i.e. after the fork() on the first MapNotify,
+ * which the threads would not survive.
+ *
+ */
+static void start_raise_watchers(void) {
+    if (raise_watchers_started)
+        return;
+    raise_watchers_started = true;
+
+    for (int i = 0; i < num_displays; i++) {
+        lock_display_t *d = &displays[i];
+        if (d->broken)
+            continue;
+
+        raise_watcher_t *watcher = calloc(1, sizeof(raise_watcher_t));
+        if (watcher == NULL)
+            continue;
+        watcher->display_name = (d->name != NULL ? strdup(d->name) : NULL);
+        watcher->window = (d == current_display ? win : d->win);
+
+        /* Failing to start a watcher is intentionally ignored here: While
+         * it is useful for preventing other windows from popping up, it is
+         * not critical. */
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, raise_thread_main, watcher) == 0) {
+            pthread_detach(thread);
+        } else {
+            free(watcher->display_name);
+            free(watcher);
+        }
+    }
+}
+
 /*
  * Called when the keyboard mapping changes. We update our symbols.
  *
@@ -565,7 +1034,48 @@ static void handle_visibility_notify(xcb_connection_t *conn,
  * screen stays locked and the user intervenes by using killall i3lock.
  *
  */
-static void process_xkb_event(xcb_generic_event_t *gevent) {
+static void reload_keymap_cb(EV_P_ ev_timer *w, int revents) {
+    lock_display_t *prev = current_display;
+
+    stop_timer(TIMER_RELOAD_KEYMAP);
+    for (int i = 0; i < num_displays; i++) {
+        lock_display_t *d = &displays[i];
+        if (!d->keymap_stale)
+            continue;
+        DEBUG("reloading the keymap\n");
+        d->keymap_stale = false;
+        d->xkb_device_id = -1;
+        display_select(d);
+        (void)load_keymap(d);
+    }
+    display_select(prev);
+}
+
+/*
+ * Reloads the keymap of the given display once no further change arrived for
+ * KEYMAP_RELOAD_DELAY.
+ *
+ */
+static void schedule_keymap_reload(lock_display_t *d) {
+    d->keymap_stale = true;
+    start_timer(TIMER_RELOAD_KEYMAP, KEYMAP_RELOAD_DELAY);
+}
+
+/*
+ * A key press must be translated with the current keymap, so a pending reload
+ * is done right away. The display must be selected.
+ *
+ */
+static void flush_keymap_reload(lock_display_t *d) {
+    if (!d->keymap_stale)
+        return;
+    DEBUG("reloading the keymap\n");
+    d->keymap_stale = false;
+    d->xkb_device_id = -1;
+    (void)load_keymap(d);
+}
+
+static void process_xkb_event(lock_display_t *d, xcb_generic_event_t *gevent) {
     union xkb_event {
         struct {
             uint8_t response_type;
@@ -581,7 +1091,11 @@ static void process_xkb_event(xcb_generic_event_t *gevent) {
 
     DEBUG("process_xkb_event for device %d\n", event->any.deviceID);
 
-    if (event->any.deviceID != xkb_x11_get_core_keyboard_device_id(conn))
+    /* The device of the core keyboard is remembered instead of asking the X
+     * server for every event. When the core keyboard changes, the reload
+     * finds the new one. */
+    if (event->any.deviceID != d->xkb_device_id &&
+        event->any.xkbType != XCB_XKB_NEW_KEYBOARD_NOTIFY)
         return;
 
     /*
@@ -592,15 +1106,15 @@ static void process_xkb_event(xcb_generic_event_t *gevent) {
     switch (event->any.xkbType) {
         case XCB_XKB_NEW_KEYBOARD_NOTIFY:
             if (event->new_keyboard_notify.changed & XCB_XKB_NKN_DETAIL_KEYCODES)
-                (void)load_keymap();
+                schedule_keymap_reload(d);
             break;
 
         case XCB_XKB_MAP_NOTIFY:
-            (void)load_keymap();
+            schedule_keymap_reload(d);
             break;
 
         case XCB_XKB_STATE_NOTIFY:
-            xkb_state_update_mask(xkb_state,
+            xkb_state_update_mask(d->xkb_state,
                                   event->state_notify.baseMods,
                                   event->state_notify.latchedMods,
                                   event->state_notify.lockedMods,
@@ -821,38 +1335,53 @@ static bool verify_png_image(const char *image_path) {
     return true;
 }
 
-#ifndef __OpenBSD__
 /*
- * Callback function for PAM. We only react on password request callbacks.
+ * Decodes the image given by --image (and --raw). Returns NULL on error, in
+ * which case we just pretend no -i was specified.
  *
  */
-static int conv_callback(int num_msg, const struct pam_message **msg,
-                         struct pam_response **resp, void *appdata_ptr) {
-    if (num_msg == 0)
-        return 1;
-
-    /* PAM expects an array of responses, one for each message */
-    if ((*resp = calloc(num_msg, sizeof(struct pam_response))) == NULL) {
-        perror("calloc");
-        return 1;
-    }
-
-    for (int c = 0; c < num_msg; c++) {
-        if (msg[c]->msg_style != PAM_PROMPT_ECHO_OFF &&
-            msg[c]->msg_style != PAM_PROMPT_ECHO_ON)
-            continue;
+static cairo_surface_t *load_image(const char *image_path, const char *image_raw_format) {
+    if (image_raw_format != NULL && image_path != NULL) {
+        /* Read image. 'read_raw_image' returns NULL on error,
+         * so we don't have to handle errors here. */
+        return read_raw_image(image_path, image_raw_format);
+    }
+    if (!verify_png_image(image_path))
+        return NULL;
 
-        /* return code is currently not used but should be set to zero */
-        resp[c]->resp_retcode = 0;
-        if ((resp[c]->resp = strdup(password)) == NULL) {
-            perror("strdup");
-            return 1;
-        }
+    cairo_surface_t *image = cairo_image_surface_create_from_png(image_path);
+    if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr, "Could not load image \"%s\": %s\n",
+                image_path, cairo_status_to_string(cairo_surface_status(image)));
+        cairo_surface_destroy(image);
+        return NULL;
     }
+    return image;
+}
 
-    return 0;
+/*
+ * In daemon mode, decodes the image again after its file changed and renders
+ * it into the (unmapped) lock windows. While locked, this waits until
+ * unlocking, so that decoding does not hold up password entry.
+ *
+ */
+static void reload_image(void) {
+    image_stale = false;
+    cairo_surface_t *image = load_image(image_file, image_file_format);
+    if (image == NULL)
+        return;
+
+    DEBUG("reloaded the image \"%s\"\n", image_file);
+    cairo_surface_destroy(img);
+    img = image;
+    redraw_screen();
+}
+
+static void image_changed_cb(EV_P_ ev_stat *w, int revents) {
+    image_stale = true;
+    if (!locked)
+        reload_image();
 }
-#endif
 
 /*
  * This callback is only a dummy, see xcb_prepare_cb and xcb_check_cb.
@@ -868,12 +1397,18 @@ static void xcb_got_event(EV_P_ struct ev_io *w, int revents) {
  *
  */
 static void xcb_prepare_cb(EV_P_ ev_prepare *w, int revents) {
-    xcb_flush(conn);
+    for (int i = 0; i < num_displays; i++) {
+        if (displays[i].broken || displays[i].owner != &displays[i])
+            continue;
+        display_select(&displays[i]);
+        xcb_flush(conn);
+    }
 }
 
 /*
  * Try closing logind sleep lock fd passed over from xss-lock, in case we're
- * being run from there.
+ * being run from there. The variable is removed, so that a later call does not
+ * close whatever file got the same number meanwhile.
  *
  */
 static void maybe_close_sleep_lock_fd(void) {
@@ -885,20 +1420,122 @@ static void maybe_close_sleep_lock_fd(void) {
             close(fd);
         }
     }
+    unsetenv("XSS_SLEEP_LOCK_FD");
 }
 
 /*
- * Instead of polling the X connection socket we leave this to
- * xcb_poll_for_event() which knows better than we can ever know.
+ * Lets the machine suspend once the first frame of the lock screen has been
+ * drawn on all displays, i.e. the X servers processed the requests.
  *
  */
-static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
+static void release_sleep_locks(void) {
+    for (int i = 0; i < num_displays; i++) {
+        if (displays[i].broken || displays[i].owner != &displays[i])
+            continue;
+        display_select(&displays[i]);
+        xcb_aux_sync(conn);
+        round_trips++;
+    }
+
+    maybe_close_sleep_lock_fd();
+#ifdef I3LOCK_LOGIND
+    logind_release();
+#endif
+}
+
+/*
+ * Draws one frame for all the redraws requested during a batch of events.
+ * Key press highlights are only shown in this one frame, redraw_timeout()
+ * removes them.
+ *
+ */
+static void finish_event_batch(void) {
+    in_event_batch = false;
+
+    if (batched_key_presses > 1)
+        DEBUG("handled %d key presses in one batch\n", batched_key_presses);
+    batched_key_presses = 0;
+
+    if (!redraw_deferred) {
+        /* The key presses did not change anything on screen. */
+        key_received_us = 0;
+        return;
+    }
+    redraw_deferred = false;
+    redraw_screen();
+
+    if (key_received_us != 0 && frame_sequence == 0 && !key_display->broken) {
+        /* The frame was drawn on all displays, measure on the one the key
+         * was pressed on. */
+        if (!key_display->display_off) {
+            display_select(key_display);
+            frame_sequence = xcb_get_input_focus(conn).sequence;
+            frame_display = key_display;
+            frame_key_received_us = key_received_us;
+            xcb_flush(conn);
+        }
+    }
+    key_received_us = 0;
+
+    if (unlock_state == STATE_KEY_ACTIVE) {
+        unlock_state = STATE_KEY_PRESSED;
+        start_timer(TIMER_REDRAW, TSTAMP_N_SECS(0.25));
+    } else if (unlock_state == STATE_BACKSPACE_ACTIVE) {
+        unlock_state = STATE_KEY_PRESSED;
+    }
+}
+
+/*
+ * Stops handling the selected display, e.g. because its X server terminated.
+ * The other displays stay locked, only when none is left, i3lock exits.
+ *
+ */
+static void drop_display(void) {
+    fprintf(stderr, "[i3lock] X11 connection to %s broke, did the server terminate?\n",
+            (current_display->name != NULL ? current_display->name : "$DISPLAY"));
+    ev_io_stop(main_loop, &current_display->watcher);
+    for (int i = 0; i < num_displays; i++) {
+        if (displays[i].owner != current_display)
+            continue;
+        displays[i].broken = true;
+        if (&displays[i] == frame_display)
+            frame_sequence = 0;
+    }
+
+    for (int i = 0; i < num_displays; i++) {
+        if (!displays[i].broken)
+            return;
+    }
+    errx(EXIT_FAILURE, "X11 connection broke, did your server terminate?");
+}
+
+/*
+ * Selects the screen of the selected display which the given window belongs
+ * to, see display_for_window().
+ *
+ */
+static void select_screen(xcb_window_t window) {
+    lock_display_t *d = display_for_window(window);
+    if (d != NULL)
+        display_select(d);
+}
+
+/*
+ * Handles the events which are queued for the given display, which must be
+ * selected. Events which concern one of its other screens are handled with
+ * that screen selected.
+ *
+ */
+static void handle_events(lock_display_t *owner) {
     xcb_generic_event_t *event;
 
-    if (xcb_connection_has_error(conn))
-        errx(EXIT_FAILURE, "X11 connection broke, did your server terminate?");
+    if (xcb_connection_has_error(conn)) {
+        drop_display();
+        return;
+    }
 
     while ((event = xcb_poll_for_event(conn)) != NULL) {
+        display_select(owner);
         if (event->response_type == 0) {
             xcb_generic_error_t *error = (xcb_generic_error_t *)event;
             if (debug_mode)
@@ -912,16 +1549,33 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
         int type = (event->response_type & 0x7F);
 
         switch (type) {
-            case XCB_KEY_PRESS:
-                handle_key_press((xcb_key_press_event_t *)event);
+            case XCB_KEY_PRESS: {
+                uint64_t now = stats_now_us();
+                stats_key_received(((xcb_key_press_event_t *)event)->time, now);
+                if (key_received_us == 0) {
+                    key_received_us = now;
+                    key_display = owner;
+                }
+
+                set_display_off(owner, false);
+                flush_keymap_reload(owner);
+                batched_key_presses++;
+                handle_key_press(owner, (xcb_key_press_event_t *)event);
                 break;
+            }
 
             case XCB_VISIBILITY_NOTIFY:
                 handle_visibility_notify(conn, (xcb_visibility_notify_event_t *)event);
                 break;
 
-            case XCB_MAP_NOTIFY:
-                maybe_close_sleep_lock_fd();
+            case XCB_MAP_NOTIFY: {
+                /* While grabbing, we also get the MapNotify events of other
+                 * clients’ windows (see grab_pointer_and_keyboard()). */
+                xcb_window_t window = ((xcb_map_notify_event_t *)event)->window;
+                lock_display_t *d = display_for_window(window);
+                if (d == NULL || window != d->win)
+                    break;
+
                 if (!dont_fork) {
                     /* After the first MapNotify, we never fork again. We don’t
                      * expect to get another MapNotify, but better be sure… */
@@ -931,20 +1585,50 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
                     if (fork() != 0)
                         exit(0);
 
+                    /* Memory locks are not inherited across fork(). */
+                    if (!secmem_lock())
+                        fprintf(stderr, "[i3lock] the password might be swapped to disk\n");
+
                     ev_loop_fork(EV_DEFAULT);
                 }
+                start_compose_loading();
+                start_raise_watchers();
                 break;
+            }
 
-            case XCB_CONFIGURE_NOTIFY:
+            case XCB_CONFIGURE_NOTIFY: {
+                /* Only the root window changing its size matters, not our
+                 * own window or other clients’ windows. */
+                xcb_window_t window = ((xcb_configure_notify_event_t *)event)->window;
+                lock_display_t *d = display_for_window(window);
+                if (d == NULL || window != d->screen->root)
+                    break;
+                display_select(d);
                 handle_screen_resize();
                 break;
+            }
+
+            case XCB_MOTION_NOTIFY:
+            case XCB_BUTTON_PRESS:
+                /* Only selected while the display is off. */
+                set_display_off(owner, false);
+                break;
 
             default:
-                if (type == xkb_base_event) {
-                    process_xkb_event(event);
+                if (owner->screensaver_base > -1 &&
+                    type == owner->screensaver_base + XCB_SCREENSAVER_NOTIFY) {
+                    uint8_t state = ((xcb_screensaver_notify_event_t *)event)->state;
+                    if (state == XCB_SCREENSAVER_STATE_ON)
+                        set_display_off(owner, true);
+                    else if (state == XCB_SCREENSAVER_STATE_OFF)
+                        set_display_off(owner, false);
+                }
+                if (type == owner->xkb_base_event) {
+                    process_xkb_event(owner, event);
                 }
-                if (randr_base > -1 &&
-                    type == randr_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
+                if (owner->randr_base > -1 &&
+                    type == owner->randr_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
+                    select_screen(((xcb_randr_screen_change_notify_event_t *)event)->root);
                     randr_query(screen->root);
                     handle_screen_resize();
                 }
@@ -952,61 +1636,485 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
 
         free(event);
     }
+    display_select(owner);
 }
 
 /*
- * This function is called from a fork()ed child and will raise the i3lock
- * window when the window is obscured, even when the main i3lock process is
- * blocked due to the authentication backend.
+ * Instead of polling the X connection sockets we leave this to
+ * xcb_poll_for_event() which knows better than we can ever know.
+ *
+ * All events which are already queued (on all displays) are handled as one
+ * batch.
  *
  */
-static void raise_loop(xcb_window_t window) {
-    xcb_connection_t *conn;
-    xcb_generic_event_t *event;
-    int screens;
+static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
+    in_event_batch = true;
+    for (int i = 0; i < num_displays; i++) {
+        if (displays[i].broken || displays[i].owner != &displays[i])
+            continue;
+        display_select(&displays[i]);
+        handle_events(&displays[i]);
+    }
 
-    if (xcb_connection_has_error((conn = xcb_connect(NULL, &screens))) > 0)
-        errx(EXIT_FAILURE, "Cannot open display");
+    void *reply;
+    xcb_generic_error_t *error;
+    if (frame_sequence != 0) {
+        display_select(frame_display);
+        if (xcb_poll_for_reply(conn, frame_sequence, &reply, &error)) {
+            stats_key_presented(frame_key_received_us);
+            frame_sequence = 0;
+            free(reply);
+            free(error);
+        }
+    }
 
-    /* We need to know about the window being obscured or getting destroyed. */
-    xcb_change_window_attributes(conn, window, XCB_CW_EVENT_MASK,
-                                 (uint32_t[]){
-                                     XCB_EVENT_MASK_VISIBILITY_CHANGE |
-                                     XCB_EVENT_MASK_STRUCTURE_NOTIFY});
-    xcb_flush(conn);
+    finish_event_batch();
+}
 
-    DEBUG("Watching window 0x%08x\n", window);
-    while ((event = xcb_wait_for_event(conn)) != NULL) {
-        if (event->response_type == 0) {
-            xcb_generic_error_t *error = (xcb_generic_error_t *)event;
-            DEBUG("X11 Error received! sequence 0x%x, error_code = %d\n",
-                  error->sequence, error->error_code);
-            free(event);
+/*
+ * Covers the selected screen with a lock window of the background color. The
+ * image and the unlock indicator are drawn on it once everything is set up.
+ *
+ */
+static void cover_screen(void) {
+    last_resolution[0] = screen->width_in_pixels;
+    last_resolution[1] = screen->height_in_pixels;
+    win = create_fullscreen_window(conn, screen, color, XCB_NONE);
+    /* In daemon mode, the window is only mapped when locking. */
+    if (!daemon_mode)
+        map_fullscreen_window(conn, win);
+
+    /* Needed to draw the “locking…” message while grabbing. */
+    init_dpi();
+}
+
+/*
+ * Sets up the selected screen: RandR and the screen saver, and the events of
+ * its root window.
+ *
+ */
+static void setup_screen(void) {
+    randr_init(&current_display->randr_base, screen->root);
+    dpms_init(&current_display->screensaver_base, screen->root);
+    randr_query(screen->root);
+
+    xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK,
+                                 (uint32_t[]){XCB_EVENT_MASK_STRUCTURE_NOTIFY});
+}
+
+/*
+ * Grabs pointer and keyboard on the selected display, whose lock windows are
+ * mapped. Returns false if that failed, after showing so for a second. This
+ * blocks, so it is only used before the main loop runs; lock_now() grabs from
+ * the main loop.
+ *
+ */
+static bool grab_display(void) {
+    current_display->stolen_focus = find_focused_window(conn, screen->root);
+    if (grab_pointer_and_keyboard(conn, screen, cursor, 100))
+        return true;
+
+    DEBUG("stole focus from X11 window 0x%08x\n", current_display->stolen_focus);
+
+    /* Set the focus to i3lock, possibly closing context menus which would
+     * otherwise prevent us from grabbing keyboard/pointer.
+     *
+     * We cannot use set_focused_window because _NET_ACTIVE_WINDOW only
+     * works for managed windows, but i3lock uses an unmanaged window
+     * (override_redirect=1). */
+    xcb_set_input_focus(conn, XCB_INPUT_FOCUS_PARENT /* revert_to */, win, XCB_CURRENT_TIME);
+    if (grab_pointer_and_keyboard(conn, screen, cursor, 1000))
+        return true;
+
+    auth_state = STATE_I3LOCK_LOCK_FAILED;
+    redraw_screen();
+    sleep(1);
+    return false;
+}
+
+/*
+ * Connects to the selected display, covers every X screen of it with a lock
+ * window and grabs pointer and keyboard. Exits if the grab fails. Every other
+ * screen of the display gets an entry of its own, the grab of the display
+ * covers them. In daemon mode, the windows stay unmapped and nothing is
+ * grabbed until lock_now().
+ *
+ * Only what the lock window and the grab need is waited for. Everything else
+ * is set up by setup_display() behind the window: Key presses meanwhile stay
+ * in the XCB queue until the keymap is loaded, along with the XKB state
+ * notifications which tell the modifier state of each of them.
+ *
+ */
+static void lock_display(int curs_choice) {
+    const char *name = current_display->name;
+
+    /* Double checking that connection is good and operatable with xcb */
+    int screennr;
+    if ((conn = xcb_connect(name, &screennr)) == NULL ||
+        xcb_connection_has_error(conn)) {
+        if (name == NULL)
+            errx(EXIT_FAILURE, "Could not connect to X11, maybe you need to set DISPLAY?");
+        errx(EXIT_FAILURE, "Could not connect to X11 display \"%s\"", name);
+    }
+    const int round_trips_before = round_trips;
+    screen = xcb_aux_get_screen(conn, screennr);
+
+    /* Over a remote connection, every round trip adds noticeably to the time
+     * until the screen is covered. So everything which does not depend on
+     * another reply is requested at once, and its replies arrive along with
+     * the one which the lock window waits for. */
+    xcb_prefetch_extension_data(conn, &xcb_xkb_id);
+    xcb_prefetch_extension_data(conn, &xcb_randr_id);
+    xcb_prefetch_extension_data(conn, &xcb_xinerama_id);
+    xcb_prefetch_extension_data(conn, &xcb_screensaver_id);
+    xcb_prefetch_extension_data(conn, &xcb_dpms_id);
+    prefetch_atoms(conn);
+    dpi_prefetch();
+
+    lock_display_t *owner = current_display;
+    owner->owner = owner;
+    cover_screen();
+    init_atoms(conn);
+
+    /* On a display with several X screens (“Zaphod mode”), leaving the other
+     * screens unlocked would show their contents. */
+    xcb_screen_iterator_t iter = xcb_setup_roots_iterator(xcb_get_setup(conn));
+    for (int n = 0; iter.rem; xcb_screen_next(&iter), n++) {
+        if (n == screennr)
+            continue;
+
+        lock_display_t *d = display_add(name);
+        if (d == NULL)
+            errx(EXIT_FAILURE, "Cannot lock more than %d screens", MAX_DISPLAYS);
+        d->owner = owner;
+        d->conn = conn;
+        d->screen = iter.data;
+        d->_NET_WM_BYPASS_COMPOSITOR = _NET_WM_BYPASS_COMPOSITOR;
+        d->_NET_ACTIVE_WINDOW = _NET_ACTIVE_WINDOW;
+        DEBUG("also locking screen %d\n", n);
+
+        display_select(d);
+        cover_screen();
+        display_select(owner);
+    }
+
+    /* XKB events are selected before grabbing, so that the state of every
+     * key press which arrives before the keymap is loaded is known. This is
+     * what xkb_x11_setup_xkb_extension() and
+     * xkb_x11_get_core_keyboard_device_id() do, one round trip each. */
+    const xcb_query_extension_reply_t *xkb_extension = xcb_get_extension_data(conn, &xcb_xkb_id);
+    if (!xkb_extension->present)
+        errx(EXIT_FAILURE, "Could not setup XKB extension.");
+    xcb_xkb_use_extension_cookie_t use_cookie =
+        xcb_xkb_use_extension(conn, XKB_X11_MIN_MAJOR_XKB_VERSION, XKB_X11_MIN_MINOR_XKB_VERSION);
+    xcb_xkb_get_device_info_cookie_t device_cookie =
+        xcb_xkb_get_device_info(conn, XCB_XKB_ID_USE_CORE_KBD, 0, 0, 0, 0, 0, 0);
+    owner->xkb_base_event = xkb_extension->first_event;
+    owner->xkb_base_error = xkb_extension->first_error;
+
+    static const xcb_xkb_map_part_t required_map_parts =
+        (XCB_XKB_MAP_PART_KEY_TYPES |
+         XCB_XKB_MAP_PART_KEY_SYMS |
+         XCB_XKB_MAP_PART_MODIFIER_MAP |
+         XCB_XKB_MAP_PART_EXPLICIT_COMPONENTS |
+         XCB_XKB_MAP_PART_KEY_ACTIONS |
+         XCB_XKB_MAP_PART_VIRTUAL_MODS |
+         XCB_XKB_MAP_PART_VIRTUAL_MOD_MAP);
+
+    static const xcb_xkb_event_type_t required_events =
+        (XCB_XKB_EVENT_TYPE_NEW_KEYBOARD_NOTIFY |
+         XCB_XKB_EVENT_TYPE_MAP_NOTIFY |
+         XCB_XKB_EVENT_TYPE_STATE_NOTIFY);
+
+    xcb_xkb_select_events(
+        conn,
+        XCB_XKB_ID_USE_CORE_KBD,
+        required_events,
+        0,
+        required_events,
+        required_map_parts,
+        required_map_parts,
+        0);
+
+    cursor = create_cursor(conn, screen, win, curs_choice);
+    if (!daemon_mode && !grab_display())
+        errx(EXIT_FAILURE, "Cannot grab pointer/keyboard");
+
+    /* Unless in daemon mode, the grab waited for a reply, so these are there
+     * already. */
+    xcb_xkb_use_extension_reply_t *use_reply = xcb_xkb_use_extension_reply(conn, use_cookie, NULL);
+    if (use_reply == NULL || !use_reply->supported)
+        errx(EXIT_FAILURE, "Could not setup XKB extension.");
+    free(use_reply);
+
+    xcb_xkb_get_device_info_reply_t *device_reply = xcb_xkb_get_device_info_reply(conn, device_cookie, NULL);
+    if (device_reply != NULL)
+        owner->xkb_device_id = device_reply->deviceID;
+    free(device_reply);
+
+    DEBUG("locked %s after %d round trips\n",
+          (name != NULL ? name : "$DISPLAY"), round_trips - round_trips_before);
+}
+
+/*
+ * Sets up what is not needed for locking the selected display: the keymap,
+ * RandR and the screen saver, for every screen of the display.
+ *
+ */
+static void setup_display(void) {
+    const int round_trips_before = round_trips;
+
+    randr_prefetch();
+    dpms_prefetch();
+
+    /* When we cannot initially load the keymap, we better exit */
+    lock_display_t *owner = current_display;
+    if (!load_keymap(owner))
+        errx(EXIT_FAILURE, "Could not load keymap");
+
+    for (int i = 0; i < num_displays; i++) {
+        if (displays[i].owner != owner)
+            continue;
+        display_select(&displays[i]);
+        setup_screen();
+    }
+    display_select(owner);
+
+    DEBUG("set up %s after %d round trips\n",
+          (owner->name != NULL ? owner->name : "$DISPLAY"), round_trips - round_trips_before);
+}
+
+/*
+ * Gives the desktops back: ungrabs, unmaps the lock windows and restores the
+ * focus. The X servers process this once the connections are flushed.
+ *
+ */
+static void unlock_displays(void) {
+    for (int i = 0; i < num_displays; i++) {
+        if (displays[i].broken)
             continue;
+        display_select(&displays[i]);
+        if (current_display == current_display->owner) {
+            xcb_ungrab_pointer(conn, XCB_CURRENT_TIME);
+            xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
         }
-        /* Strip off the highest bit (set if the event is generated) */
-        int type = (event->response_type & 0x7F);
-        DEBUG("Read event of type %d\n", type);
-        switch (type) {
-            case XCB_VISIBILITY_NOTIFY:
-                handle_visibility_notify(conn, (xcb_visibility_notify_event_t *)event);
-                break;
-            case XCB_UNMAP_NOTIFY:
-                DEBUG("UnmapNotify for 0x%08x\n", (((xcb_unmap_notify_event_t *)event)->window));
-                if (((xcb_unmap_notify_event_t *)event)->window == window)
-                    exit(EXIT_SUCCESS);
-                break;
-            case XCB_DESTROY_NOTIFY:
-                DEBUG("DestroyNotify for 0x%08x\n", (((xcb_destroy_notify_event_t *)event)->window));
-                if (((xcb_destroy_notify_event_t *)event)->window == window)
-                    exit(EXIT_SUCCESS);
-                break;
-            default:
-                DEBUG("Unhandled event type %d\n", type);
-                break;
+        xcb_unmap_window(conn, win);
+        if (current_display->stolen_focus != XCB_NONE) {
+            DEBUG("restoring focus to X11 window 0x%08x\n", current_display->stolen_focus);
+            set_focused_window(conn, screen->root, current_display->stolen_focus);
+            current_display->stolen_focus = XCB_NONE;
         }
-        free(event);
+        xcb_flush(conn);
+    }
+    locked = false;
+    raise_watchers_started = false;
+    if (clock_visible)
+        ev_periodic_stop(main_loop, &clock_update);
+    control_set_state(CONTROL_UNLOCKED);
+}
+
+/*
+ * Waits until every X server processed what was sent to it, e.g. the unlock,
+ * so that the desktops are visible when this returns.
+ *
+ */
+static void sync_displays(void) {
+    for (int i = 0; i < num_displays; i++) {
+        if (displays[i].broken || displays[i].owner != &displays[i])
+            continue;
+        display_select(&displays[i]);
+        xcb_aux_sync(conn);
+    }
+}
+
+/*
+ * Finishes lock_now() once every display is grabbed.
+ *
+ */
+static void lock_done(void) {
+    grab_next = -1;
+    for (int i = 0; i < num_displays; i++) {
+        if (displays[i].broken || displays[i].owner != &displays[i])
+            continue;
+        /* DPMS does not tell us when the display woke up. */
+        set_display_off(&displays[i], false);
+    }
+
+    /* The frame was drawn when the screen was unlocked last, which may be
+     * long ago. */
+    if (clock_visible) {
+        redraw_screen();
+        start_clock();
     }
+
+    /* Suspending waited for the lock screen since lock_now(). */
+    release_sleep_locks();
+
+    control_set_state(CONTROL_LOCKED);
+    control_lock_done(true);
+    DEBUG("locked in %.1f ms\n", (stats_now_us() - lock_started) / 1000.0);
+}
+
+/*
+ * Gives up locking: Shows so for a second, like without --daemon, and then
+ * unlocks again (see lock_failed_cb()).
+ *
+ */
+static void lock_failed(void) {
+    grab_next = -1;
+    fprintf(stderr, "[i3lock] cannot grab pointer/keyboard, not locking\n");
+    auth_state = STATE_I3LOCK_LOCK_FAILED;
+    redraw_screen();
+#ifdef I3LOCK_LOGIND
+    logind_release();
+#endif
+    control_lock_done(false);
+    start_timer(TIMER_LOCK_FAILED, TSTAMP_N_SECS(1));
+}
+
+static void lock_failed_cb(EV_P_ ev_timer *w, int revents) {
+    unlock_displays();
+    auth_state = STATE_AUTH_IDLE;
+    redraw_screen();
+}
+
+/*
+ * Grabs the displays one after another, starting at grab_next, with a single
+ * attempt each. If one fails, the next attempt is scheduled on the main loop,
+ * which keeps running meanwhile.
+ *
+ */
+static void grab_displays(void) {
+    for (; grab_next < num_displays; grab_next++) {
+        if (displays[grab_next].broken || displays[grab_next].owner != &displays[grab_next]) {
+            /* The connection may have broken between two attempts. */
+            grab_attempts = 0;
+            continue;
+        }
+        display_select(&displays[grab_next]);
+        if (grab_attempts++ == 0) {
+            current_display->stolen_focus = find_focused_window(conn, screen->root);
+            grab_started = ev_time();
+            grab_delay = GRAB_RETRY_MIN;
+            grab_focus_stolen = false;
+        }
+        if (!grab_pointer_and_keyboard(conn, screen, cursor, 0))
+            break;
+        grab_attempts = 0;
+    }
+    if (grab_next == num_displays) {
+        lock_done();
+        return;
+    }
+
+    const ev_tstamp waited = ev_time() - grab_started;
+    if (waited >= GRAB_TIMEOUT) {
+        lock_failed();
+        return;
+    }
+    if (!grab_focus_stolen && waited >= GRAB_STEAL_FOCUS) {
+        DEBUG("stole focus from X11 window 0x%08x\n", current_display->stolen_focus);
+        /* Closes context menus, see grab_display(). */
+        xcb_set_input_focus(conn, XCB_INPUT_FOCUS_PARENT /* revert_to */, win, XCB_CURRENT_TIME);
+        xcb_flush(conn);
+        grab_focus_stolen = true;
+    }
+    start_timer(TIMER_GRAB, grab_delay);
+    if (grab_delay < GRAB_RETRY_MAX)
+        grab_delay *= 2;
+}
+
+static void grab_retry_cb(EV_P_ ev_timer *w, int revents) {
+    grab_displays();
+}
+
+/*
+ * Locks the screen in daemon mode. Everything is set up already and the lock
+ * windows show the first frame already, so this only maps them and grabs.
+ * Grabbing may have to wait for other clients, so it only starts here and
+ * finishes in lock_done() or lock_failed().
+ *
+ */
+static void lock_now(void) {
+    if (locked) {
+        /* While grabbing, lock_done() or lock_failed() answers. */
+        if (grab_next == -1)
+            control_lock_done(!ev_is_active(&timers[TIMER_LOCK_FAILED]));
+        return;
+    }
+
+    lock_started = stats_now_us();
+#ifdef I3LOCK_LOGIND
+    /* Like when starting without --daemon, suspending waits until the lock
+     * screen is up (lock_done()). */
+    logind_inhibit();
+#endif
+    locked = true;
+    failed_attempts = 0;
+    for (int i = 0; i < num_displays; i++) {
+        if (displays[i].broken)
+            continue;
+        display_select(&displays[i]);
+        map_fullscreen_window(conn, win);
+    }
+
+    grab_next = 0;
+    grab_attempts = 0;
+    grab_displays();
+}
+
+static void lock_signal_cb(EV_P_ ev_signal *w, int revents) {
+    lock_now();
+}
+
+/*
+ * Unlocks in daemon mode, and prepares the next lock right away: fresh
+ * authentication helpers, and lock windows which show the initial state.
+ *
+ */
+static void finish_unlock(void) {
+    unlock_displays();
+    /* Like on exit, the unlock only counts once the desktops are visible. */
+    sync_displays();
+    stats_auth_mark(AUTH_PHASE_TEARDOWN);
+    stats_auth_commit();
+
+    for (int i = 0; i < TIMER_COUNT; i++) {
+        if (i != TIMER_RELOAD_KEYMAP)
+            stop_timer(i);
+    }
+    clear_input();
+    /* Nothing of what was typed may outlive the lock: The UTF-8 of the last
+     * key, keys held back for the compose table and a pending compose
+     * sequence are all password-derived. */
+    secmem_clear(key_buffer, KEY_BUFFER_SIZE);
+    secmem_clear(held_keys, MAX_HELD_KEYS * sizeof(struct held_key));
+    num_held_keys = 0;
+    if (xkb_compose_state != NULL)
+        xkb_compose_state_reset(xkb_compose_state);
+    retry_verification = false;
+    free(modifier_string);
+    modifier_string = NULL;
+    auth_state = STATE_AUTH_IDLE;
+    unlock_state = STATE_STARTED;
+    auth_prepare();
+
+    if (image_stale)
+        reload_image();
+    else
+        redraw_screen();
+}
+
+static void init_timers(void) {
+    ev_init(&timers[TIMER_CLEAR_AUTH_WRONG], clear_auth_wrong);
+    ev_init(&timers[TIMER_CLEAR_INDICATOR], clear_indicator_cb);
+    ev_init(&timers[TIMER_DISCARD_PASSWD], discard_passwd_cb);
+    ev_init(&timers[TIMER_REDRAW], redraw_timeout);
+    ev_init(&timers[TIMER_AUTH_TIMEOUT], auth_timeout_cb);
+    ev_init(&timers[TIMER_RELOAD_KEYMAP], reload_keymap_cb);
+    ev_init(&timers[TIMER_GRAB], grab_retry_cb);
+    ev_init(&timers[TIMER_LOCK_FAILED], lock_failed_cb);
+    ev_init(&timers[TIMER_DISPLAY_OFF_POLL], display_off_poll_cb);
 }
 
 int main(int argc, char *argv[]) {
@@ -1014,10 +2122,7 @@ int main(int argc, char *argv[]) {
     char *username;
     char *image_path = NULL;
     char *image_raw_format = NULL;
-#ifndef __OpenBSD__
-    int ret;
-    struct pam_conv conv = {conv_callback, NULL};
-#endif
+    const char *socket_path = NULL;
     int curs_choice = CURS_NONE;
     int o;
     int longoptind = 0;
@@ -1038,12 +2143,27 @@ int main(int argc, char *argv[]) {
         {"ignore-empty-password", no_argument, NULL, 'e'},
         {"inactivity-timeout", required_argument, NULL, 'I'},
         {"show-failed-attempts", no_argument, NULL, 'f'},
+        {"auth-timeout", required_argument, NULL, 0},
+        {"pam-service", required_argument, NULL, 0},
+        {"display", required_argument, NULL, 0},
+        {"socket", required_argument, NULL, 0},
+        {"daemon", no_argument, NULL, 0},
         {NULL, no_argument, NULL, 0}};
 
+#ifdef I3LOCK_LOGIND
+    /* Suspending waits for the first frame from here on, see
+     * release_sleep_locks(). Nothing that comes before it can delay the
+     * inhibitor, and none of the helpers forked later keeps it (it is
+     * close-on-exec and they close all inherited descriptors). */
+    logind_inhibit();
+#endif
+
     if ((pw = getpwuid(getuid())) == NULL)
         err(EXIT_FAILURE, "getpwuid() failed");
     if ((username = pw->pw_name) == NULL)
         errx(EXIT_FAILURE, "pw->pw_name is NULL.");
+    stats_init();
+
     if (getenv("WAYLAND_DISPLAY") != NULL)
         errx(EXIT_FAILURE, "i3lock is a program for X11 and does not work on Wayland. Try https://github.com/swaywm/swaylock instead");
 
@@ -1106,6 +2226,24 @@ int main(int argc, char *argv[]) {
                     debug_mode = true;
                 else if (strcmp(longopts[longoptind].name, "raw") == 0)
                     image_raw_format = strdup(optarg);
+                else if (strcmp(longopts[longoptind].name, "auth-timeout") == 0) {
+                    char *endptr;
+                    auth_timeout = strtod(optarg, &endptr);
+                    if (*endptr != '\0' || endptr == optarg || auth_timeout < 0)
+                        errx(EXIT_FAILURE, "i3lock: Invalid authentication timeout given. Expected a number of seconds.");
+                } else if (strcmp(longopts[longoptind].name, "pam-service") == 0) {
+                    if (num_pam_services == AUTH_MAX_SERVICES)
+                        errx(EXIT_FAILURE, "i3lock: At most %d PAM services can be given.", AUTH_MAX_SERVICES);
+                    pam_services[num_pam_services++] = optarg;
+                } else if (strcmp(longopts[longoptind].name, "display") == 0) {
+                    if (display_add(optarg) == NULL)
+                        errx(EXIT_FAILURE, "i3lock: At most %d displays can be given.", MAX_DISPLAYS);
+                } else if (strcmp(longopts[longoptind].name, "socket") == 0)
+                    socket_path = optarg;
+                else if (strcmp(longopts[longoptind].name, "daemon") == 0) {
+                    daemon_mode = true;
+                    dont_fork = true;
+                }
                 break;
             case 'f':
                 show_failed_attempts = true;
@@ -1120,71 +2258,52 @@ int main(int argc, char *argv[]) {
      * the unlock indicator upon keypresses. */
     srand(time(NULL));
 
-#ifndef __OpenBSD__
-    /* Initialize PAM */
-    if ((ret = pam_start("i3lock", username, &conv, &pam_handle)) != PAM_SUCCESS)
-        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
-
-    if ((ret = pam_set_item(pam_handle, PAM_TTY, getenv("DISPLAY"))) != PAM_SUCCESS)
-        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
-#endif
-
-/* Using mlock() as non-super-user seems only possible in Linux.
- * Users of other operating systems should use encrypted swap/no swap
- * (or remove the ifdef and run i3lock as super-user).
- * Alas, swap is encrypted by default on OpenBSD so swapping out
- * is not necessarily an issue. */
-#if defined(__linux__)
-    /* Lock the area where we store the password in memory, we don’t want it to
-     * be swapped to disk. Since Linux 2.6.9, this does not require any
-     * privileges, just enough bytes in the RLIMIT_MEMLOCK limit. */
-    if (mlock(password, sizeof(password)) != 0)
-        err(EXIT_FAILURE, "Could not lock page in memory, check RLIMIT_MEMLOCK");
-#endif
-
-    /* Double checking that connection is good and operatable with xcb */
-    int screennr;
-    if ((conn = xcb_connect(NULL, &screennr)) == NULL ||
-        xcb_connection_has_error(conn))
-        errx(EXIT_FAILURE, "Could not connect to X11, maybe you need to set DISPLAY?");
-
-    if (xkb_x11_setup_xkb_extension(conn,
-                                    XKB_X11_MIN_MAJOR_XKB_VERSION,
-                                    XKB_X11_MIN_MINOR_XKB_VERSION,
-                                    0,
-                                    NULL,
-                                    NULL,
-                                    &xkb_base_event,
-                                    &xkb_base_error) != 1)
-        errx(EXIT_FAILURE, "Could not setup XKB extension.");
-
-    static const xcb_xkb_map_part_t required_map_parts =
-        (XCB_XKB_MAP_PART_KEY_TYPES |
-         XCB_XKB_MAP_PART_KEY_SYMS |
-         XCB_XKB_MAP_PART_MODIFIER_MAP |
-         XCB_XKB_MAP_PART_EXPLICIT_COMPONENTS |
-         XCB_XKB_MAP_PART_KEY_ACTIONS |
-         XCB_XKB_MAP_PART_VIRTUAL_MODS |
-         XCB_XKB_MAP_PART_VIRTUAL_MOD_MAP);
+    /* Initialize the libev event loop. */
+    main_loop = EV_DEFAULT;
+    if (main_loop == NULL)
+        errx(EXIT_FAILURE, "Could not initialize libev. Bad LIBEV_FLAGS?");
+    init_timers();
 
-    static const xcb_xkb_event_type_t required_events =
-        (XCB_XKB_EVENT_TYPE_NEW_KEYBOARD_NOTIFY |
-         XCB_XKB_EVENT_TYPE_MAP_NOTIFY |
-         XCB_XKB_EVENT_TYPE_STATE_NOTIFY);
+    if (num_displays == 0)
+        (void)display_add(NULL);
 
-    xcb_xkb_select_events(
-        conn,
-        xkb_x11_get_core_keyboard_device_id(conn),
-        required_events,
-        0,
-        required_events,
-        required_map_parts,
-        required_map_parts,
-        0);
+    /* Cover the screens before anything else, every millisecond until then
+     * the desktop stays visible. The entries of further screens, which are
+     * added meanwhile, share the connection.
+     *
+     * The "locking…" message is displayed while trying to grab the
+     * pointer/keyboard. */
+    auth_state = STATE_AUTH_LOCK;
+    for (int i = 0; i < num_displays; i++) {
+        if (displays[i].owner != NULL)
+            continue;
+        display_select(&displays[i]);
+        lock_display(curs_choice);
+    }
 
-    /* When we cannot initially load the keymap, we better exit */
-    if (!load_keymap())
-        errx(EXIT_FAILURE, "Could not load keymap");
+    /* All buffers which hold (parts of) the password live in a locked arena,
+     * we don’t want them to be swapped to disk. */
+    if (!secmem_init(SECMEM_SIZE) ||
+        (password = secmem_alloc(PASSWORD_SIZE)) == NULL ||
+        (key_buffer = secmem_alloc(KEY_BUFFER_SIZE)) == NULL ||
+        (held_keys = secmem_alloc(MAX_HELD_KEYS * sizeof(struct held_key))) == NULL)
+        errx(EXIT_FAILURE, "Could not set up locked memory for the password");
+
+    /* Initialize the authentication backend (PAM or BSD Auth). This forks,
+     * so it has to come before any thread is started. */
+    if (num_pam_services == 0)
+        pam_services[num_pam_services++] = "i3lock";
+    if (!auth_init(main_loop, username, pam_services, num_pam_services, auth_done))
+        errx(EXIT_FAILURE, "Could not initialize the authentication backend");
+    if (daemon_mode)
+        stats_auth_track_setcred();
+
+    for (int i = 0; i < num_displays; i++) {
+        if (displays[i].owner != &displays[i])
+            continue;
+        display_select(&displays[i]);
+        setup_display();
+    }
 
     const char *locale = getenv("LC_ALL");
     if (!locale || !*locale)
@@ -1196,106 +2315,44 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Can't detect your locale, fallback to C\n");
         locale = "C";
     }
-
-    load_compose_table(locale);
-
-    screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
-
-    init_dpi();
-
-    randr_init(&randr_base, screen->root);
-    randr_query(screen->root);
-
-    last_resolution[0] = screen->width_in_pixels;
-    last_resolution[1] = screen->height_in_pixels;
-
-    xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK,
-                                 (uint32_t[]){XCB_EVENT_MASK_STRUCTURE_NOTIFY});
-
-    if (image_raw_format != NULL && image_path != NULL) {
-        /* Read image. 'read_raw_image' returns NULL on error,
-         * so we don't have to handle errors here. */
-        img = read_raw_image(image_path, image_raw_format);
-    } else if (verify_png_image(image_path)) {
-        /* Create a pixmap to render on, fill it with the background color */
-        img = cairo_image_surface_create_from_png(image_path);
-        /* In case loading failed, we just pretend no -i was specified. */
-        if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
-            fprintf(stderr, "Could not load image \"%s\": %s\n",
-                    image_path, cairo_status_to_string(cairo_surface_status(img)));
-            img = NULL;
-        }
-    }
-
-    free(image_path);
-    free(image_raw_format);
-
-    /* Pixmap on which the image is rendered to (if any) */
-    xcb_pixmap_t bg_pixmap = create_bg_pixmap(conn, screen, last_resolution, color);
-    draw_image(bg_pixmap, last_resolution);
-
-    xcb_window_t stolen_focus = find_focused_window(conn, screen->root);
-
-    /* Open the fullscreen window, already with the correct pixmap in place */
-    win = open_fullscreen_window(conn, screen, color, bg_pixmap);
-    xcb_free_pixmap(conn, bg_pixmap);
-
-    cursor = create_cursor(conn, screen, win, curs_choice);
-
-    /* Display the "locking…" message while trying to grab the pointer/keyboard. */
-    auth_state = STATE_AUTH_LOCK;
-    if (!grab_pointer_and_keyboard(conn, screen, cursor, 1000)) {
-        DEBUG("stole focus from X11 window 0x%08x\n", stolen_focus);
-
-        /* Set the focus to i3lock, possibly closing context menus which would
-         * otherwise prevent us from grabbing keyboard/pointer.
-         *
-         * We cannot use set_focused_window because _NET_ACTIVE_WINDOW only
-         * works for managed windows, but i3lock uses an unmanaged window
-         * (override_redirect=1). */
-        xcb_set_input_focus(conn, XCB_INPUT_FOCUS_PARENT /* revert_to */, win, XCB_CURRENT_TIME);
-        if (!grab_pointer_and_keyboard(conn, screen, cursor, 9000)) {
-            auth_state = STATE_I3LOCK_LOCK_FAILED;
-            redraw_screen();
-            sleep(1);
-            errx(EXIT_FAILURE, "Cannot grab pointer/keyboard");
-        }
-    }
-
-    pid_t pid = fork();
-    /* The pid == -1 case is intentionally ignored here:
-     * While the child process is useful for preventing other windows from
-     * popping up while i3lock blocks, it is not critical. */
-    if (pid == 0) {
-        /* Child */
-        close(xcb_get_file_descriptor(conn));
-        maybe_close_sleep_lock_fd();
-        raise_loop(win);
-        exit(EXIT_SUCCESS);
+    /* The compose table is loaded once the window is mapped, or right away
+     * in daemon mode (see below). */
+    compose_locale = locale;
+
+    /* The image is decoded once and drawn on all displays. */
+    img = load_image(image_path, image_raw_format);
+    if (daemon_mode && image_path != NULL) {
+        image_file = image_path;
+        image_file_format = image_raw_format;
+        ev_stat_init(&image_watcher, image_changed_cb, image_file, 0.);
+        ev_stat_start(main_loop, &image_watcher);
+    } else {
+        free(image_path);
+        free(image_raw_format);
     }
 
-    /* Load the keymap again to sync the current modifier state. Since we first
-     * loaded the keymap, there might have been changes, but starting from now,
-     * we should get all key presses/releases due to having grabbed the
-     * keyboard. */
-    (void)load_keymap();
-
-    /* Initialize the libev event loop. */
-    main_loop = EV_DEFAULT;
-    if (main_loop == NULL)
-        errx(EXIT_FAILURE, "Could not initialize libev. Bad LIBEV_FLAGS?");
-
-    /* Explicitly call the screen redraw in case "locking…" message was displayed */
+    /* The first complete frame, replacing the solid color (and the
+     * "locking…" message, if it was displayed). */
     auth_state = STATE_AUTH_IDLE;
     redraw_screen();
+    release_sleep_locks();
+    DEBUG("%s after %d round trips in total\n", (daemon_mode ? "ready" : "locked"), round_trips);
+
+    if (daemon_mode)
+        start_compose_loading();
 
-    struct ev_io *xcb_watcher = calloc(sizeof(struct ev_io), 1);
     struct ev_check *xcb_check = calloc(sizeof(struct ev_check), 1);
     struct ev_prepare *xcb_prepare = calloc(sizeof(struct ev_prepare), 1);
-    struct ev_periodic clock_update;
+    struct ev_signal dump_stats;
+    struct ev_signal lock_signal;
 
-    ev_io_init(xcb_watcher, xcb_got_event, xcb_get_file_descriptor(conn), EV_READ);
-    ev_io_start(main_loop, xcb_watcher);
+    for (int i = 0; i < num_displays; i++) {
+        if (displays[i].owner != &displays[i])
+            continue;
+        display_select(&displays[i]);
+        ev_io_init(&current_display->watcher, xcb_got_event, xcb_get_file_descriptor(conn), EV_READ);
+        ev_io_start(main_loop, &current_display->watcher);
+    }
 
     ev_check_init(xcb_check, xcb_check_cb);
     ev_check_start(main_loop, xcb_check);
@@ -1303,9 +2360,25 @@ int main(int argc, char *argv[]) {
     ev_prepare_init(xcb_prepare, xcb_prepare_cb);
     ev_prepare_start(main_loop, xcb_prepare);
 
+    /* Locking works without the socket, so failing to create it only
+     * disables it. */
+    if (socket_path != NULL && !control_init(main_loop, socket_path, (daemon_mode ? lock_now : NULL)))
+        fprintf(stderr, "[i3lock] could not create the control socket\n");
+    if (daemon_mode)
+        control_set_state(CONTROL_UNLOCKED);
+
     if (clock_visible) {
         ev_periodic_init(&clock_update, clock_minute_cb, 0., 60., 0);
-        ev_periodic_start(main_loop, &clock_update);
+        start_clock();
+    }
+
+    /* Print the latency histograms on SIGUSR1, or on SIGUSR2 in daemon mode,
+     * where SIGUSR1 locks. */
+    ev_signal_init(&dump_stats, dump_stats_cb, (daemon_mode ? SIGUSR2 : SIGUSR1));
+    ev_signal_start(main_loop, &dump_stats);
+    if (daemon_mode) {
+        ev_signal_init(&lock_signal, lock_signal_cb, SIGUSR1);
+        ev_signal_start(main_loop, &lock_signal);
     }
 
     /* Invoke the event callback once to catch all the events which were
@@ -1314,22 +2387,21 @@ int main(int argc, char *argv[]) {
     ev_invoke(main_loop, xcb_check, 0);
     ev_loop(main_loop, 0);
 
-#ifndef __OpenBSD__
-    if (pam_cleanup) {
-        pam_end(pam_handle, PAM_SUCCESS);
-    }
-#endif
+    /* Give the desktops back before anything else. The helper refreshes the
+     * credentials and ends the PAM transaction in the background. */
+    unlock_displays();
+    control_cleanup();
 
-    if (stolen_focus == XCB_NONE) {
-        return 0;
-    }
+    auth_cleanup();
+    secmem_wipe();
 
-    DEBUG("restoring focus to X11 window 0x%08x\n", stolen_focus);
-    xcb_ungrab_pointer(conn, XCB_CURRENT_TIME);
-    xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
-    xcb_destroy_window(conn, win);
-    set_focused_window(conn, screen->root, stolen_focus);
-    xcb_aux_sync(conn);
+    /* The desktops are visible once the X servers processed the above. These
+     * round trips only delay the exit of i3lock, not the unlock. */
+    sync_displays();
+    stats_auth_mark(AUTH_PHASE_TEARDOWN);
+    stats_auth_commit();
+    if (debug_mode)
+        stats_print();
 
     return 0;
 }
@@ -0,0 +1,270 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * keytable.c: precomputes what every key does (for every layout and shift
+ *             level) whenever the keymap is loaded, so that handling a key
+ *             press is a table lookup instead of a keysym lookup, UTF-8
+ *             conversion and compose state machine run.
+ *
+ * The tables of the last few keymaps are cached, keyed by a hash of the
+ * serialized keymap, so that switching back and forth between layouts does
+ * not rebuild them. Every locked display (see display.c) has its own table,
+ * which stays allocated while any display uses it.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <xkbcommon/xkbcommon.h>
+#include <xkbcommon/xkbcommon-compose.h>
+
+#include "i3lock.h"
+#include "keytable.h"
+
+/* Keys with more levels than this take the slow path. */
+#define KEYTABLE_MAX_LEVELS 8
+
+/* The number of tables which are kept around. */
+#define KEYTABLE_CACHE_SIZE 4
+
+extern bool debug_mode;
+
+typedef struct keytable {
+    /* FNV-1a hash of the serialized keymap. */
+    uint64_t hash;
+    /* The compose table the table was built with (only compared). */
+    struct xkb_compose_table *compose_table;
+    uint64_t last_used;
+    /* The number of displays using the table. */
+    int users;
+    bool cached;
+
+    xkb_keycode_t min_keycode;
+    xkb_keycode_t max_keycode;
+    xkb_layout_index_t num_layouts;
+    xkb_mod_index_t ctrl_index;
+    xkb_mod_index_t caps_index;
+    key_entry_t entries[];
+} keytable_t;
+
+static keytable_t *cache[KEYTABLE_CACHE_SIZE];
+static uint64_t cache_clock;
+
+/*
+ * Returns what a key press with the given keysym does. n is the size of its
+ * UTF-8 including the terminating NUL byte (as returned by
+ * xkb_keysym_to_utf8()).
+ *
+ */
+key_action_t keytable_action(xkb_keysym_t ksym, bool ctrl, int n) {
+    switch (ksym) {
+        case XKB_KEY_Return:
+        case XKB_KEY_KP_Enter:
+        case XKB_KEY_XF86ScreenSaver:
+            return KEY_SUBMIT;
+        case XKB_KEY_j:
+        case XKB_KEY_m:
+            if (ctrl)
+                return KEY_SUBMIT;
+            break;
+
+        case XKB_KEY_Escape:
+            return KEY_CLEAR;
+        case XKB_KEY_u:
+            if (ctrl)
+                return KEY_CLEAR;
+            break;
+
+        case XKB_KEY_Delete:
+        case XKB_KEY_KP_Delete:
+            /* Deleting forward doesn’t make sense, as i3lock doesn’t allow you
+             * to move the cursor when entering a password. We need to eat this
+             * key press so that it won’t be treated as part of the password,
+             * see issue #50. */
+            return KEY_IGNORE;
+
+        case XKB_KEY_BackSpace:
+            return KEY_BACKSPACE;
+        case XKB_KEY_h:
+            if (ctrl)
+                return KEY_BACKSPACE;
+            break;
+    }
+
+    return (n < 2 ? KEY_IGNORE : KEY_APPEND);
+}
+
+static key_entry_t *entry(keytable_t *t, xkb_keycode_t keycode, xkb_layout_index_t layout, xkb_level_index_t level) {
+    return &t->entries[((keycode - t->min_keycode) * t->num_layouts + layout) * KEYTABLE_MAX_LEVELS + level];
+}
+
+static void fill_entry(key_entry_t *e, xkb_keysym_t ksym, struct xkb_compose_state *compose_state) {
+    char utf8[8];
+    int n = xkb_keysym_to_utf8(ksym, utf8, sizeof(utf8));
+    if (n < 1 || n > (int)sizeof(e->utf8))
+        n = 1;
+
+    e->keysym = ksym;
+    e->action = keytable_action(ksym, false, n);
+    e->ctrl_action = keytable_action(ksym, true, n);
+    e->utf8_len = n - 1;
+    memcpy(e->utf8, utf8, n - 1);
+
+    if (compose_state != NULL) {
+        xkb_compose_state_reset(compose_state);
+        e->compose_start = (xkb_compose_state_feed(compose_state, ksym) == XKB_COMPOSE_FEED_ACCEPTED &&
+                            xkb_compose_state_get_status(compose_state) == XKB_COMPOSE_COMPOSING);
+    }
+}
+
+static uint64_t hash_keymap(struct xkb_keymap *keymap) {
+    char *serialized = xkb_keymap_get_as_string(keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
+    uint64_t hash = UINT64_C(14695981039346656037);
+
+    if (serialized == NULL)
+        return 0;
+    for (const char *c = serialized; *c != '\0'; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= UINT64_C(1099511628211);
+    }
+    free(serialized);
+    return hash;
+}
+
+static keytable_t *build(struct xkb_keymap *keymap, struct xkb_compose_table *compose_table) {
+    xkb_keycode_t min_keycode = xkb_keymap_min_keycode(keymap);
+    xkb_keycode_t max_keycode = xkb_keymap_max_keycode(keymap);
+    xkb_layout_index_t num_layouts = 1;
+    for (xkb_keycode_t keycode = min_keycode; keycode <= max_keycode; keycode++) {
+        xkb_layout_index_t n = xkb_keymap_num_layouts_for_key(keymap, keycode);
+        if (n > num_layouts)
+            num_layouts = n;
+    }
+
+    size_t entries = (size_t)(max_keycode - min_keycode + 1) * num_layouts * KEYTABLE_MAX_LEVELS;
+    keytable_t *t = calloc(1, sizeof(keytable_t) + entries * sizeof(key_entry_t));
+    if (t == NULL) {
+        fprintf(stderr, "[i3lock] could not allocate the key table, using the slow path\n");
+        return NULL;
+    }
+    t->compose_table = compose_table;
+    t->min_keycode = min_keycode;
+    t->max_keycode = max_keycode;
+    t->num_layouts = num_layouts;
+    t->ctrl_index = xkb_keymap_mod_get_index(keymap, XKB_MOD_NAME_CTRL);
+    t->caps_index = xkb_keymap_mod_get_index(keymap, XKB_MOD_NAME_CAPS);
+
+    struct xkb_compose_state *compose_state = NULL;
+    if (compose_table != NULL)
+        compose_state = xkb_compose_state_new(compose_table, 0);
+
+    for (xkb_keycode_t keycode = min_keycode; keycode <= max_keycode; keycode++) {
+        xkb_layout_index_t layouts = xkb_keymap_num_layouts_for_key(keymap, keycode);
+        for (xkb_layout_index_t layout = 0; layout < layouts; layout++) {
+            xkb_level_index_t levels = xkb_keymap_num_levels_for_key(keymap, keycode, layout);
+            if (levels > KEYTABLE_MAX_LEVELS)
+                levels = KEYTABLE_MAX_LEVELS;
+            for (xkb_level_index_t level = 0; level < levels; level++) {
+                const xkb_keysym_t *syms;
+                /* Like xkb_state_key_get_one_sym(), keys with several
+                 * keysyms on one level produce nothing. */
+                int num_syms = xkb_keymap_key_get_syms_by_level(keymap, keycode, layout, level, &syms);
+                fill_entry(entry(t, keycode, layout, level),
+                           (num_syms == 1 ? syms[0] : XKB_KEY_NoSymbol),
+                           compose_state);
+            }
+        }
+    }
+
+    xkb_compose_state_unref(compose_state);
+    DEBUG("built key table for keycodes %u to %u, %u layouts\n", min_keycode, max_keycode, num_layouts);
+    return t;
+}
+
+static keytable_t *lookup_or_build(struct xkb_keymap *keymap, struct xkb_compose_table *compose_table) {
+    uint64_t hash = hash_keymap(keymap);
+    int slot = -1;
+    for (int i = 0; i < KEYTABLE_CACHE_SIZE; i++) {
+        keytable_t *t = cache[i];
+        if (t != NULL && hash != 0 && t->hash == hash && t->compose_table == compose_table) {
+            DEBUG("using the cached key table for keymap %016" PRIx64 "\n", hash);
+            t->last_used = ++cache_clock;
+            return t;
+        }
+        /* Replace an empty slot or else the least recently used table which
+         * no display uses. */
+        if (t != NULL && t->users > 0)
+            continue;
+        if (slot == -1 || (cache[slot] != NULL && (t == NULL || t->last_used < cache[slot]->last_used)))
+            slot = i;
+    }
+
+    keytable_t *t = build(keymap, compose_table);
+    if (t == NULL)
+        return NULL;
+    t->hash = hash;
+    t->last_used = ++cache_clock;
+    if (slot != -1) {
+        free(cache[slot]);
+        cache[slot] = t;
+        t->cached = true;
+    }
+    return t;
+}
+
+static void release(keytable_t *t) {
+    if (t != NULL && --t->users == 0 && !t->cached)
+        free(t);
+}
+
+/*
+ * Returns the table for the given keymap, building it unless it is cached,
+ * which replaces the display's old table. The compose table may be NULL (e.g.
+ * while it is not loaded yet), no keysym starts a sequence then.
+ *
+ */
+keytable_t *keytable_build(keytable_t *old, struct xkb_keymap *keymap, struct xkb_compose_table *compose_table) {
+    keytable_t *table = (keymap == NULL ? NULL : lookup_or_build(keymap, compose_table));
+    if (table != NULL)
+        table->users++;
+    release(old);
+    return table;
+}
+
+/*
+ * Returns what pressing the given key does in the given state, or NULL if the
+ * key has to take the slow path: The table does not cover it, or Caps Lock is
+ * active, in which case xkbcommon might apply its capitalization
+ * transformation.
+ *
+ */
+const key_entry_t *keytable_lookup(keytable_t *table, struct xkb_state *state, xkb_keycode_t keycode) {
+    if (table == NULL || keycode < table->min_keycode || keycode > table->max_keycode)
+        return NULL;
+
+    if (table->caps_index != XKB_MOD_INVALID &&
+        xkb_state_mod_index_is_active(state, table->caps_index, XKB_STATE_MODS_EFFECTIVE) > 0)
+        return NULL;
+
+    xkb_layout_index_t layout = xkb_state_key_get_layout(state, keycode);
+    if (layout == XKB_LAYOUT_INVALID || layout >= table->num_layouts)
+        return NULL;
+
+    xkb_level_index_t level = xkb_state_key_get_level(state, keycode, layout);
+    if (level == XKB_LEVEL_INVALID || level >= KEYTABLE_MAX_LEVELS)
+        return NULL;
+
+    return entry(table, keycode, layout, level);
+}
+
+bool keytable_ctrl_active(keytable_t *table, struct xkb_state *state) {
+    if (table == NULL)
+        return (xkb_state_mod_name_is_active(state, XKB_MOD_NAME_CTRL, XKB_STATE_MODS_DEPRESSED) > 0);
+    return (table->ctrl_index != XKB_MOD_INVALID &&
+            xkb_state_mod_index_is_active(state, table->ctrl_index, XKB_STATE_MODS_DEPRESSED) > 0);
+}
@@ -0,0 +1,34 @@
+#ifndef _KEYTABLE_H
+#define _KEYTABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xkbcommon/xkbcommon.h>
+#include <xkbcommon/xkbcommon-compose.h>
+
+typedef enum {
+    KEY_IGNORE = 0, /* modifiers, keys without text, Delete */
+    KEY_APPEND,     /* append the text to the password */
+    KEY_SUBMIT,     /* Return, KP_Enter, XF86ScreenSaver, C-j, C-m */
+    KEY_CLEAR,      /* Escape, C-u */
+    KEY_BACKSPACE,  /* BackSpace, C-h */
+} key_action_t;
+
+/* What pressing a key does at a specific layout and shift level. */
+typedef struct key_entry {
+    xkb_keysym_t keysym;
+    uint8_t action;
+    uint8_t ctrl_action;
+    /* Whether the keysym starts a compose sequence. */
+    bool compose_start;
+    uint8_t utf8_len;
+    char utf8[8];
+} key_entry_t;
+
+key_action_t keytable_action(xkb_keysym_t ksym, bool ctrl, int n);
+struct keytable *keytable_build(struct keytable *old, struct xkb_keymap *keymap,
+                               struct xkb_compose_table *compose_table);
+const key_entry_t *keytable_lookup(struct keytable *table, struct xkb_state *state, xkb_keycode_t keycode);
+bool keytable_ctrl_active(struct keytable *table, struct xkb_state *state);
+
+#endif
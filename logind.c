@@ -0,0 +1,94 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * logind.c: takes a delay inhibitor for sleep from systemd-logind while
+ *           i3lock starts (or, with --daemon, locks), so that suspending waits
+ *           until the lock screen is actually on screen. Without it, the machine can suspend before
+ *           the first frame is drawn and show the desktop for a moment after
+ *           resuming. Only built when libsystemd is available.
+ *
+ * The inhibitor is taken on the system bus, so it can be tested against a
+ * mock logind on a private dbus-daemon by pointing DBUS_SYSTEM_BUS_ADDRESS at
+ * that daemon, see bench/logind-test.py.
+ *
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <systemd/sd-bus.h>
+
+#include "i3lock.h"
+#include "logind.h"
+
+/* How long to wait for logind before locking without the inhibitor. */
+#define LOGIND_TIMEOUT_USEC (500 * 1000)
+
+extern bool debug_mode;
+
+static int inhibitor_fd = -1;
+
+/*
+ * Asks logind for a delay inhibitor for sleep. Without logind (or the system
+ * bus), i3lock locks all the same.
+ *
+ */
+void logind_inhibit(void) {
+    sd_bus *bus = NULL;
+    sd_bus_message *m = NULL;
+    sd_bus_message *reply = NULL;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    int fd;
+    int r;
+
+    if (inhibitor_fd != -1)
+        return;
+
+    if ((r = sd_bus_open_system(&bus)) < 0) {
+        DEBUG("logind: cannot connect to the system bus: %s\n", strerror(-r));
+        return;
+    }
+
+    r = sd_bus_message_new_method_call(bus, &m,
+                                       "org.freedesktop.login1",
+                                       "/org/freedesktop/login1",
+                                       "org.freedesktop.login1.Manager",
+                                       "Inhibit");
+    if (r >= 0)
+        r = sd_bus_message_append(m, "ssss", "sleep", "i3lock", "Locking the screen", "delay");
+    if (r >= 0)
+        r = sd_bus_call(bus, m, LOGIND_TIMEOUT_USEC, &error, &reply);
+    if (r >= 0)
+        r = sd_bus_message_read(reply, "h", &fd);
+    /* The file descriptor belongs to the reply, which we free below. */
+    if (r >= 0 && (inhibitor_fd = fcntl(fd, F_DUPFD_CLOEXEC, 3)) == -1)
+        r = -errno;
+
+    if (r < 0)
+        DEBUG("logind: could not take a sleep inhibitor: %s\n",
+              (sd_bus_error_is_set(&error) ? error.message : strerror(-r)));
+    else
+        DEBUG("logind: took sleep inhibitor (fd %d)\n", inhibitor_fd);
+
+    sd_bus_error_free(&error);
+    sd_bus_message_unref(reply);
+    sd_bus_message_unref(m);
+    sd_bus_flush_close_unref(bus);
+}
+
+/*
+ * Lets the machine suspend.
+ *
+ */
+void logind_release(void) {
+    if (inhibitor_fd == -1)
+        return;
+
+    DEBUG("logind: releasing sleep inhibitor\n");
+    close(inhibitor_fd);
+    inhibitor_fd = -1;
+}
@@ -0,0 +1,7 @@
+#ifndef _LOGIND_H
+#define _LOGIND_H
+
+void logind_inhibit(void);
+void logind_release(void);
+
+#endif
@@ -0,0 +1,301 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * mock_auth.c: a mock authentication backend for reproducible benchmarks and
+ *              tests of the auth path, only built with --enable-mock-auth.
+ *              It is configured using the following environment variables:
+ *
+ *   I3LOCK_MOCK_PASSWORD          the correct password (default: “i3lock”)
+ *   I3LOCK_MOCK_LATENCY           time pam_authenticate() takes, see below
+ *   I3LOCK_MOCK_SETCRED_LATENCY   time pam_setcred() takes, see below
+ *   I3LOCK_MOCK_FAILURE_RATE      probability (0 to 1) that even the correct
+ *                                 password is rejected (default: 0)
+ *   I3LOCK_MOCK_CONV_MESSAGES     number of messages per conversation: the
+ *                                 password prompt plus informational messages
+ *                                 (default: 1)
+ *   I3LOCK_MOCK_SEED              seed for latencies and failures (default:
+ *                                 random), for reproducible runs
+ *
+ * Every helper process draws from its own stream, derived from the seed, the
+ * index of its PAM service and how often that helper was started, so that
+ * concurrent services and respawned helpers do not repeat each other.
+ *
+ * Latencies are given in milliseconds as “<ms>”, “fixed:<ms>”,
+ * “uniform:<min>:<max>”, “normal:<mean>:<stddev>” or “exp:<mean>”.
+ *
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+#include <unistd.h>
+#ifdef HAVE_EXPLICIT_BZERO
+#include <strings.h> /* explicit_bzero(3) */
+#endif
+
+#include "i3lock.h"
+#include "mock_auth.h"
+
+#define MOCK_MAX_CONV_MESSAGES 32
+
+extern bool debug_mode;
+
+typedef enum {
+    LATENCY_FIXED = 0,
+    LATENCY_UNIFORM,
+    LATENCY_NORMAL,
+    LATENCY_EXP,
+} latency_kind_t;
+
+typedef struct latency {
+    latency_kind_t kind;
+    double a;
+    double b;
+} latency_t;
+
+static struct mock_config {
+    bool initialized;
+    const char *password;
+    latency_t latency;
+    latency_t setcred_latency;
+    double failure_rate;
+    int conv_messages;
+    uint64_t state;
+} config;
+
+/* Set by mock_auth_seed() before the backend is initialized. */
+static int stream_service;
+static unsigned int stream_spawn;
+
+/*
+ * splitmix64, used to turn similar inputs (e.g. consecutive pids) into
+ * unrelated xorshift seeds.
+ *
+ */
+static uint64_t mix64(uint64_t x) {
+    x += UINT64_C(0x9e3779b97f4a7c15);
+    x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return x ^ (x >> 31);
+}
+
+/*
+ * xorshift64*, so that runs with the same seed behave the same on every libc.
+ * Returns a number in [0, 1).
+ *
+ */
+static double mock_random(void) {
+    config.state ^= config.state >> 12;
+    config.state ^= config.state << 25;
+    config.state ^= config.state >> 27;
+    return ((config.state * UINT64_C(2685821657736338717)) >> 11) / (double)(UINT64_C(1) << 53);
+}
+
+static latency_t parse_latency(const char *name) {
+    latency_t latency = {LATENCY_FIXED, 0, 0};
+    const char *value = getenv(name);
+
+    if (value == NULL || *value == '\0')
+        return latency;
+
+    if (sscanf(value, "fixed:%lf", &latency.a) == 1 ||
+        sscanf(value, "%lf", &latency.a) == 1)
+        latency.kind = LATENCY_FIXED;
+    else if (sscanf(value, "uniform:%lf:%lf", &latency.a, &latency.b) == 2)
+        latency.kind = LATENCY_UNIFORM;
+    else if (sscanf(value, "normal:%lf:%lf", &latency.a, &latency.b) == 2)
+        latency.kind = LATENCY_NORMAL;
+    else if (sscanf(value, "exp:%lf", &latency.a) == 1)
+        latency.kind = LATENCY_EXP;
+    else
+        errx(EXIT_FAILURE, "%s: invalid latency \"%s\"", name, value);
+
+    return latency;
+}
+
+static void mock_init(void) {
+    if (config.initialized)
+        return;
+
+    config.password = getenv("I3LOCK_MOCK_PASSWORD");
+    if (config.password == NULL)
+        config.password = "i3lock";
+
+    config.latency = parse_latency("I3LOCK_MOCK_LATENCY");
+    config.setcred_latency = parse_latency("I3LOCK_MOCK_SETCRED_LATENCY");
+
+    const char *value;
+    if ((value = getenv("I3LOCK_MOCK_FAILURE_RATE")) != NULL)
+        config.failure_rate = strtod(value, NULL);
+
+    config.conv_messages = 1;
+    if ((value = getenv("I3LOCK_MOCK_CONV_MESSAGES")) != NULL)
+        config.conv_messages = atoi(value);
+    if (config.conv_messages < 1)
+        config.conv_messages = 1;
+    if (config.conv_messages > MOCK_MAX_CONV_MESSAGES)
+        config.conv_messages = MOCK_MAX_CONV_MESSAGES;
+
+    uint64_t seed;
+    if ((value = getenv("I3LOCK_MOCK_SEED")) != NULL && *value != '\0') {
+        seed = strtoull(value, NULL, 10);
+    } else {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        seed = mix64(((uint64_t)getpid() << 32) ^ (uint64_t)ts.tv_sec * 1000000000 ^ ts.tv_nsec);
+    }
+    config.state = mix64(seed ^ mix64(((uint64_t)stream_service << 32) | stream_spawn));
+    /* xorshift must not start from 0. */
+    if (config.state == 0)
+        config.state = 1;
+    DEBUG("mock: service %d, start %u, seed %llu\n", stream_service, stream_spawn,
+          (unsigned long long)seed);
+
+    fprintf(stderr, "[i3lock] WARNING: using the mock authentication backend, do not use this build for locking\n");
+    config.initialized = true;
+}
+
+/*
+ * Called in a freshly forked helper: service is the index of its PAM service,
+ * spawn the number of helpers which were started for it before.
+ *
+ */
+void mock_auth_seed(int service, unsigned int spawn) {
+    stream_service = service;
+    stream_spawn = spawn;
+}
+
+static void mock_sleep(const latency_t *latency) {
+    double ms = latency->a;
+
+    switch (latency->kind) {
+        case LATENCY_FIXED:
+            break;
+        case LATENCY_UNIFORM:
+            ms = latency->a + mock_random() * (latency->b - latency->a);
+            break;
+        case LATENCY_NORMAL:
+            /* Box-Muller transform */
+            ms = latency->a + latency->b * sqrt(-2.0 * log(1.0 - mock_random())) *
+                                  cos(2.0 * M_PI * mock_random());
+            break;
+        case LATENCY_EXP:
+            ms = -latency->a * log(1.0 - mock_random());
+            break;
+    }
+
+    if (ms <= 0)
+        return;
+
+    DEBUG("mock: sleeping for %.3f ms\n", ms);
+    struct timespec ts = {
+        .tv_sec = (time_t)(ms / 1000),
+        .tv_nsec = (long)(fmod(ms, 1000) * 1000000),
+    };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        continue;
+}
+
+/*
+ * Returns whether the given password is correct, after sleeping for the
+ * configured latency and maybe rejecting it anyway.
+ *
+ */
+static bool mock_verify(const char *password) {
+    mock_sleep(&config.latency);
+
+    if (password == NULL || strcmp(password, config.password) != 0)
+        return false;
+
+    if (config.failure_rate > 0 && mock_random() < config.failure_rate) {
+        DEBUG("mock: rejecting the correct password\n");
+        return false;
+    }
+
+    return true;
+}
+
+#ifdef __OpenBSD__
+int mock_auth_userokay(char *name, char *style, char *type, char *password) {
+    mock_init();
+    return mock_verify(password);
+}
+#else
+struct pam_handle {
+    struct pam_conv conv;
+};
+
+int mock_pam_start(const char *service_name, const char *user,
+                   const struct pam_conv *pam_conversation, pam_handle_t **pamh) {
+    mock_init();
+
+    if ((*pamh = calloc(1, sizeof(struct pam_handle))) == NULL)
+        return PAM_BUF_ERR;
+    (*pamh)->conv = *pam_conversation;
+    return PAM_SUCCESS;
+}
+
+int mock_pam_set_item(pam_handle_t *pamh, int item_type, const void *item) {
+    return PAM_SUCCESS;
+}
+
+int mock_pam_authenticate(pam_handle_t *pamh, int flags) {
+    struct pam_message messages[MOCK_MAX_CONV_MESSAGES];
+    const struct pam_message *msgp[MOCK_MAX_CONV_MESSAGES];
+    char texts[MOCK_MAX_CONV_MESSAGES][32];
+    struct pam_response *resp = NULL;
+
+    for (int c = 0; c < config.conv_messages; c++) {
+        if (c == 0) {
+            messages[c].msg_style = PAM_PROMPT_ECHO_OFF;
+            messages[c].msg = "Password: ";
+        } else {
+            snprintf(texts[c], sizeof(texts[c]), "mock message %d", c);
+            messages[c].msg_style = PAM_TEXT_INFO;
+            messages[c].msg = texts[c];
+        }
+        msgp[c] = &messages[c];
+    }
+
+    if (pamh->conv.conv(config.conv_messages, msgp, &resp, pamh->conv.appdata_ptr) != PAM_SUCCESS ||
+        resp == NULL)
+        return PAM_CONV_ERR;
+
+    bool success = mock_verify(resp[0].resp);
+
+    for (int c = 0; c < config.conv_messages; c++) {
+        if (resp[c].resp == NULL)
+            continue;
+#ifdef HAVE_EXPLICIT_BZERO
+        explicit_bzero(resp[c].resp, strlen(resp[c].resp));
+#endif
+        free(resp[c].resp);
+    }
+    free(resp);
+
+    return (success ? PAM_SUCCESS : PAM_AUTH_ERR);
+}
+
+int mock_pam_setcred(pam_handle_t *pamh, int flags) {
+    mock_sleep(&config.setcred_latency);
+    return PAM_SUCCESS;
+}
+
+int mock_pam_end(pam_handle_t *pamh, int pam_status) {
+    free(pamh);
+    return PAM_SUCCESS;
+}
+
+const char *mock_pam_strerror(pam_handle_t *pamh, int errnum) {
+    return (errnum == PAM_SUCCESS ? "Success" : "Mock authentication failure");
+}
+#endif
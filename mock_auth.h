@@ -0,0 +1,34 @@
+#ifndef _MOCK_AUTH_H
+#define _MOCK_AUTH_H
+
+/* Only used in builds configured with --enable-mock-auth: Replaces the
+ * authentication backend with a mock which is configured using environment
+ * variables (see mock_auth.c), for benchmarks and tests of the auth path
+ * without real credentials. */
+
+void mock_auth_seed(int service, unsigned int spawn);
+
+#ifdef __OpenBSD__
+int mock_auth_userokay(char *name, char *style, char *type, char *password);
+
+#define auth_userokay mock_auth_userokay
+#else
+#include <security/pam_appl.h>
+
+int mock_pam_start(const char *service_name, const char *user,
+                   const struct pam_conv *pam_conversation, pam_handle_t **pamh);
+int mock_pam_set_item(pam_handle_t *pamh, int item_type, const void *item);
+int mock_pam_authenticate(pam_handle_t *pamh, int flags);
+int mock_pam_setcred(pam_handle_t *pamh, int flags);
+int mock_pam_end(pam_handle_t *pamh, int pam_status);
+const char *mock_pam_strerror(pam_handle_t *pamh, int errnum);
+
+#define pam_start mock_pam_start
+#define pam_set_item mock_pam_set_item
+#define pam_authenticate mock_pam_authenticate
+#define pam_setcred mock_pam_setcred
+#define pam_end mock_pam_end
+#define pam_strerror mock_pam_strerror
+#endif
+
+#endif
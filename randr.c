@@ -17,6 +17,7 @@
 #include "i3lock.h"
 #include "xcb.h"
 #include "randr.h"
+#include "display.h"
 
 /* Number of Xinerama screens which are currently present. */
 int xr_screens = 0;
@@ -24,13 +25,26 @@ int xr_screens = 0;
 /* The resolutions of the currently present Xinerama screens. */
 Rect *xr_resolutions = NULL;
 
-static bool xinerama_active;
-static bool has_randr = false;
-static bool has_randr_1_5 = false;
+bool xinerama_active;
+bool has_randr = false;
+bool has_randr_1_5 = false;
 extern bool debug_mode;
 
+/* Sent by randr_prefetch(), 0 if not outstanding. */
+static xcb_randr_query_version_cookie_t version_cookie;
+
 void _xinerama_init(void);
 
+/*
+ * Asks for the RandR version without waiting for the reply, which
+ * randr_init() reads. The extension data needs to be prefetched.
+ *
+ */
+void randr_prefetch(void) {
+    if (xcb_get_extension_data(conn, &xcb_randr_id)->present)
+        version_cookie = xcb_randr_query_version(conn, XCB_RANDR_MAJOR_VERSION, XCB_RANDR_MINOR_VERSION);
+}
+
 void randr_init(int *event_base, xcb_window_t root) {
     const xcb_query_extension_reply_t *extreply;
 
@@ -41,10 +55,14 @@ void randr_init(int *event_base, xcb_window_t root) {
         return;
     }
 
+    if (version_cookie.sequence == 0) {
+        version_cookie = xcb_randr_query_version(conn, XCB_RANDR_MAJOR_VERSION, XCB_RANDR_MINOR_VERSION);
+        round_trips++;
+    }
     xcb_generic_error_t *err;
     xcb_randr_query_version_reply_t *randr_version =
-        xcb_randr_query_version_reply(
-            conn, xcb_randr_query_version(conn, XCB_RANDR_MAJOR_VERSION, XCB_RANDR_MINOR_VERSION), &err);
+        xcb_randr_query_version_reply(conn, version_cookie, &err);
+    version_cookie.sequence = 0;
     if (err != NULL) {
         DEBUG("Could not query RandR version: X11 error code %d\n", err->error_code);
         _xinerama_init();
@@ -80,6 +98,7 @@ void _xinerama_init(void) {
     xcb_xinerama_is_active_reply_t *reply;
 
     cookie = xcb_xinerama_is_active(conn);
+    round_trips++;
     reply = xcb_xinerama_is_active_reply(conn, cookie, NULL);
     if (!reply)
         return;
@@ -108,6 +127,7 @@ static bool _randr_query_monitors_15(xcb_window_t root) {
     /* RandR 1.5 available at run-time (supported by the server) */
     DEBUG("Querying monitors using RandR 1.5\n");
     xcb_generic_error_t *err;
+    round_trips++;
     xcb_randr_get_monitors_reply_t *monitors =
         xcb_randr_get_monitors_reply(
             conn, xcb_randr_get_monitors(conn, root, true), &err);
@@ -166,6 +186,7 @@ static bool _randr_query_outputs_14(xcb_window_t root) {
     /* Get screen resources (primary output, crtcs, outputs, modes) */
     xcb_randr_get_screen_resources_current_cookie_t rcookie;
     rcookie = xcb_randr_get_screen_resources_current(conn, root);
+    round_trips++;
 
     xcb_randr_get_screen_resources_current_reply_t *res =
         xcb_randr_get_screen_resources_current_reply(conn, rcookie, NULL);
@@ -11,6 +11,7 @@ typedef struct Rect {
 extern int xr_screens;
 extern Rect *xr_resolutions;
 
+void randr_prefetch(void);
 void randr_init(int *event_base, xcb_window_t root);
 void randr_query(xcb_window_t root);
 
@@ -0,0 +1,128 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * secmem.c: a small arena for everything derived from the password (the
+ *           password buffers, the UTF-8 of key presses and compose
+ *           sequences). The arena is a dedicated mapping which is locked into
+ *           memory, excluded from core dumps and surrounded by guard pages,
+ *           so that an overflow faults instead of leaking into the heap.
+ *
+ * Allocations live until the process exits. Instead of clearing every buffer
+ * separately when unlocking, secmem_wipe() clears the whole arena at once.
+ *
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef HAVE_EXPLICIT_BZERO
+#include <strings.h> /* explicit_bzero(3) */
+#endif
+
+#include "secmem.h"
+
+#define SECMEM_ALIGN 16
+
+static char *arena;
+static size_t arena_size;
+static size_t arena_used;
+
+/*
+ * Maps the arena with one inaccessible guard page on either side and locks
+ * it into memory.
+ *
+ */
+bool secmem_init(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    arena_size = (size + page - 1) / page * page;
+    char *mapping = mmap(NULL, arena_size + 2 * page, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    arena = mapping + page;
+    if (mprotect(arena, arena_size, PROT_READ | PROT_WRITE) != 0) {
+        perror("mprotect");
+        return false;
+    }
+
+#ifdef MADV_DONTDUMP
+    madvise(arena, arena_size, MADV_DONTDUMP);
+#elif defined(MADV_NOCORE)
+    madvise(arena, arena_size, MADV_NOCORE);
+#endif
+
+    return secmem_lock();
+}
+
+/*
+ * Locks the arena into memory, we don’t want it to be swapped to disk. Since
+ * memory locks are not inherited across fork(), children need to call this
+ * again.
+ *
+ * Using mlock() as non-super-user seems only possible in Linux. Users of other
+ * operating systems should use encrypted swap/no swap (or run i3lock as
+ * super-user). Alas, swap is encrypted by default on OpenBSD so swapping out
+ * is not necessarily an issue.
+ *
+ */
+bool secmem_lock(void) {
+    if (mlock(arena, arena_size) == 0)
+        return true;
+#if defined(__linux__)
+    /* Since Linux 2.6.9, this does not require any privileges, just enough
+     * bytes in the RLIMIT_MEMLOCK limit. */
+    perror("Could not lock page in memory, check RLIMIT_MEMLOCK");
+    return false;
+#else
+    return true;
+#endif
+}
+
+/*
+ * Returns size zeroed bytes from the arena. When the arena is exhausted, this
+ * returns NULL; SECMEM_SIZE needs to be raised then.
+ *
+ */
+void *secmem_alloc(size_t size) {
+    size = (size + SECMEM_ALIGN - 1) / SECMEM_ALIGN * SECMEM_ALIGN;
+    if (arena == NULL || size > arena_size - arena_used)
+        return NULL;
+
+    void *result = arena + arena_used;
+    arena_used += size;
+    return result;
+}
+
+/*
+ * Clears the given memory in a way which the compiler does not optimize out.
+ *
+ */
+void secmem_clear(void *buf, size_t len) {
+#ifdef HAVE_EXPLICIT_BZERO
+    explicit_bzero(buf, len);
+#else
+    volatile char *vbuf = buf;
+    for (size_t c = 0; c < len; c++)
+        vbuf[c] = '\0';
+#endif
+}
+
+/*
+ * Clears the contents of all allocations, which stay valid.
+ *
+ */
+void secmem_wipe(void) {
+    if (arena != NULL)
+        secmem_clear(arena, arena_used);
+}
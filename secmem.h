@@ -0,0 +1,17 @@
+#ifndef _SECMEM_H
+#define _SECMEM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The usable size of the arena. It holds the password buffers of i3lock and
+ * of the authentication helper, plus the key press buffers. */
+#define SECMEM_SIZE 16384
+
+bool secmem_init(size_t size);
+bool secmem_lock(void);
+void *secmem_alloc(size_t size);
+void secmem_clear(void *buf, size_t len);
+void secmem_wipe(void);
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * stats.c: in-memory latency histograms, e.g. of the phases of the
+ *          authentication path or of key presses until they are drawn,
+ *          printed at exit (with --debug) and on SIGUSR1.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "auth.h"
+#include "stats.h"
+
+/* The histograms of the time spent between a phase and the previous phase
+ * which the attempt reached, plus one for the whole attempt. */
+static histogram_t auth_histograms[AUTH_PHASE_COUNT] = {
+    [AUTH_PHASE_KEY_ENTER] = {.name = "key-enter → desktop visible (total)"},
+    [AUTH_PHASE_START] = {.name = "→ pam_authenticate() called"},
+    [AUTH_PHASE_CONV] = {.name = "→ conv_callback() called"},
+    [AUTH_PHASE_AUTHENTICATED] = {.name = "→ pam_authenticate() returned"},
+    [AUTH_PHASE_VERDICT] = {.name = "→ verdict received"},
+    [AUTH_PHASE_TEARDOWN] = {.name = "→ window unmapped"},
+};
+
+/* pam_setcred() runs after unlocking, so it is not one of the phases. Without
+ * --daemon, i3lock has exited by the time it finishes, so the histogram is only
+ * kept (and printed) with --daemon, see stats_auth_track_setcred(). */
+static histogram_t setcred_histogram = {.name = "pam_setcred() (after unlocking)"};
+static bool setcred_tracked = false;
+
+/* The time each authentication service took to deliver its verdict. */
+static histogram_t service_histograms[AUTH_MAX_SERVICES];
+static int num_services;
+
+/* The time between the X server generating a key press and i3lock reading
+ * it, and between i3lock reading it and the X server having drawn the frame
+ * which shows it. */
+static histogram_t key_queue_histogram = {.name = "key press → received by i3lock"};
+static histogram_t key_frame_histogram = {.name = "received → frame drawn"};
+
+/* Timestamps of the attempt in flight, 0 for phases it did not reach. */
+static uint64_t auth_timestamps[AUTH_PHASE_COUNT];
+
+/* Whether stderr was open when i3lock started. If it was not, file descriptor
+ * 2 might since have been re-used (e.g. for the X11 connection). */
+static bool stderr_usable;
+
+/*
+ * Returns the current time of the monotonic clock in microseconds. The clock
+ * is system-wide, so timestamps of different processes are comparable.
+ *
+ */
+uint64_t stats_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void histogram_add(histogram_t *h, uint64_t us) {
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && us >= ((uint64_t)1 << bucket))
+        bucket++;
+
+    h->buckets[bucket]++;
+    if (h->count == 0 || us < h->min_us)
+        h->min_us = us;
+    if (us > h->max_us)
+        h->max_us = us;
+    h->sum_us += us;
+    h->count++;
+}
+
+/*
+ * Returns the p-th percentile (0 < p < 1) of the samples, interpolated within
+ * its bucket. Since buckets are powers of two, this is only an estimate.
+ *
+ */
+uint64_t histogram_percentile(const histogram_t *h, double p) {
+    if (h->count == 0)
+        return 0;
+
+    double rank = p * h->count;
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        if (h->buckets[bucket] == 0 || seen + h->buckets[bucket] < rank) {
+            seen += h->buckets[bucket];
+            continue;
+        }
+
+        /* Bucket b holds [2^(b-1), 2^b), clamped to the samples we saw. */
+        double lower = (bucket == 0 ? 0 : (double)((uint64_t)1 << (bucket - 1)));
+        double upper = (bucket == HISTOGRAM_BUCKETS - 1 ? h->max_us : (double)((uint64_t)1 << bucket));
+        if (lower < h->min_us)
+            lower = h->min_us;
+        if (upper > h->max_us)
+            upper = h->max_us;
+        return lower + (upper - lower) * (rank - seen) / h->buckets[bucket];
+    }
+    return h->max_us;
+}
+
+void histogram_print(const histogram_t *h, FILE *f) {
+    if (h->count == 0) {
+        fprintf(f, "  %s: no samples\n", h->name);
+        return;
+    }
+
+    fprintf(f, "  %s: n=%" PRIu64 " min=%.3fms avg=%.3fms max=%.3fms\n",
+            h->name, h->count, h->min_us / 1000.0,
+            (double)h->sum_us / h->count / 1000.0, h->max_us / 1000.0);
+    fprintf(f, "    p50=%.3fms p95=%.3fms p99=%.3fms\n",
+            histogram_percentile(h, 0.50) / 1000.0,
+            histogram_percentile(h, 0.95) / 1000.0,
+            histogram_percentile(h, 0.99) / 1000.0);
+
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        if (h->buckets[bucket] == 0)
+            continue;
+        if (bucket == HISTOGRAM_BUCKETS - 1)
+            fprintf(f, "    >= %10.3fms: %" PRIu64 "\n",
+                    ((uint64_t)1 << (bucket - 1)) / 1000.0, h->buckets[bucket]);
+        else
+            fprintf(f, "    <  %10.3fms: %" PRIu64 "\n",
+                    ((uint64_t)1 << bucket) / 1000.0, h->buckets[bucket]);
+    }
+}
+
+void stats_init(void) {
+    stderr_usable = (fcntl(STDERR_FILENO, F_GETFD) != -1);
+}
+
+void stats_auth_mark(auth_phase_t phase) {
+    stats_auth_set(phase, stats_now_us());
+}
+
+void stats_auth_set(auth_phase_t phase, uint64_t us) {
+    /* Pressing Enter starts a new attempt. */
+    if (phase == AUTH_PHASE_KEY_ENTER)
+        memset(auth_timestamps, 0, sizeof(auth_timestamps));
+    auth_timestamps[phase] = us;
+}
+
+/*
+ * Adds the attempt in flight to the histograms.
+ *
+ */
+void stats_auth_commit(void) {
+    uint64_t first = 0;
+    uint64_t prev = 0;
+
+    for (int phase = 0; phase < AUTH_PHASE_COUNT; phase++) {
+        uint64_t ts = auth_timestamps[phase];
+        if (ts == 0)
+            continue;
+        if (first == 0)
+            first = ts;
+        else if (ts >= prev)
+            histogram_add(&auth_histograms[phase], ts - prev);
+        prev = ts;
+    }
+
+    if (auth_timestamps[AUTH_PHASE_KEY_ENTER] != 0 && prev > first)
+        histogram_add(&auth_histograms[AUTH_PHASE_KEY_ENTER], prev - first);
+
+    memset(auth_timestamps, 0, sizeof(auth_timestamps));
+}
+
+void stats_auth_track_setcred(void) {
+    setcred_tracked = true;
+}
+
+void stats_auth_setcred(uint64_t us) {
+    if (setcred_tracked)
+        histogram_add(&setcred_histogram, us);
+}
+
+/*
+ * Returns the histogram of the verdict latency of the given authentication
+ * service (e.g. PAM service), which is created on first use. The name must
+ * stay valid.
+ *
+ */
+histogram_t *stats_auth_service(const char *service) {
+    static histogram_t overflow = {.name = "other services"};
+
+    for (int i = 0; i < num_services; i++) {
+        if (strcmp(service_histograms[i].name, service) == 0)
+            return &service_histograms[i];
+    }
+
+    if (num_services == AUTH_MAX_SERVICES)
+        return &overflow;
+
+    service_histograms[num_services].name = service;
+    return &service_histograms[num_services++];
+}
+
+/*
+ * Records that i3lock read a key press at the given time. server_time is the
+ * timestamp of the event, in milliseconds. The Xorg server takes it from the
+ * same monotonic clock as stats_now_us(), other (e.g. remote) servers do not,
+ * so implausible differences are ignored.
+ *
+ */
+void stats_key_received(uint32_t server_time, uint64_t us) {
+    uint32_t delay_ms = (uint32_t)(us / 1000) - server_time;
+    if (delay_ms < 10000)
+        histogram_add(&key_queue_histogram, (uint64_t)delay_ms * 1000);
+}
+
+/*
+ * Records that the X server has drawn the frame showing the key press which
+ * i3lock read at received_us.
+ *
+ */
+void stats_key_presented(uint64_t received_us) {
+    uint64_t now = stats_now_us();
+    if (now >= received_us)
+        histogram_add(&key_frame_histogram, now - received_us);
+}
+
+void stats_print(void) {
+    if (!stderr_usable)
+        return;
+
+    fprintf(stderr, "[i3lock] authentication latency:\n");
+    for (int phase = 0; phase < AUTH_PHASE_COUNT; phase++)
+        histogram_print(&auth_histograms[phase], stderr);
+    if (setcred_tracked)
+        histogram_print(&setcred_histogram, stderr);
+
+    fprintf(stderr, "[i3lock] password handed out → verdict, per service:\n");
+    for (int i = 0; i < num_services; i++)
+        histogram_print(&service_histograms[i], stderr);
+
+    fprintf(stderr, "[i3lock] key press latency:\n");
+    histogram_print(&key_queue_histogram, stderr);
+    histogram_print(&key_frame_histogram, stderr);
+}
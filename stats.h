@@ -0,0 +1,48 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Buckets are powers of two of microseconds, the last one is open-ended. */
+#define HISTOGRAM_BUCKETS 28
+
+typedef struct histogram {
+    const char *name;
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t min_us;
+    uint64_t max_us;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+/* The phases of an authentication attempt, in chronological order. */
+typedef enum {
+    AUTH_PHASE_KEY_ENTER = 0, /* Enter was pressed (i3lock) */
+    AUTH_PHASE_START,         /* pam_authenticate() is called (helper) */
+    AUTH_PHASE_CONV,          /* PAM asked for the password (helper) */
+    AUTH_PHASE_AUTHENTICATED, /* pam_authenticate() returned (helper) */
+    AUTH_PHASE_VERDICT,       /* the verdict arrived (i3lock) */
+    AUTH_PHASE_TEARDOWN,      /* the X server unmapped the window (i3lock) */
+    AUTH_PHASE_COUNT,
+} auth_phase_t;
+
+uint64_t stats_now_us(void);
+
+void histogram_add(histogram_t *h, uint64_t us);
+uint64_t histogram_percentile(const histogram_t *h, double p);
+void histogram_print(const histogram_t *h, FILE *f);
+
+void stats_init(void);
+void stats_auth_mark(auth_phase_t phase);
+void stats_auth_set(auth_phase_t phase, uint64_t us);
+void stats_auth_commit(void);
+void stats_auth_track_setcred(void);
+void stats_auth_setcred(uint64_t us);
+histogram_t *stats_auth_service(const char *service);
+void stats_key_received(uint32_t server_time, uint64_t us);
+void stats_key_presented(uint64_t received_us);
+void stats_print(void);
+
+#endif
@@ -22,6 +22,7 @@
 #include "unlock_indicator.h"
 #include "randr.h"
 #include "dpi.h"
+#include "display.h"
 
 #define BUTTON_RADIUS 90
 #define BUTTON_SPACE (BUTTON_RADIUS + 5)
@@ -102,7 +103,17 @@ static const int nord14[] __attribute__((unused)) = { 0xa3, 0xbe, 0x8c };
 static const int nord15[] __attribute__((unused)) = { 0xb4, 0x8e, 0xad };
 
 /* Cache the screen’s visual, necessary for creating a Cairo context. */
-static xcb_visualtype_t *vistype;
+xcb_visualtype_t *vistype;
+
+/* The unlock indicator and the clock of the current frame. During
+ * redraw_screen(), they are rendered once and composited onto every screen
+ * (screens with another DPI render their own). */
+static struct {
+    bool shared;
+    double scaling_factor;
+    cairo_surface_t *indicator;
+    cairo_surface_t *clock;
+} rendered;
 
 /* Maintain the current unlock/PAM state to draw the appropriate unlock
  * indicator. */
@@ -110,63 +121,14 @@ unlock_state_t unlock_state;
 auth_state_t auth_state;
 
 /*
- * Draws global image with fill color onto a pixmap with the given
- * resolution and returns it.
+ * Renders the unlock indicator for the current state onto a new in-memory
+ * surface (which stays transparent while the indicator is hidden).
  *
  */
-void draw_image(xcb_pixmap_t bg_pixmap, uint32_t *resolution) {
-    const double scaling_factor = get_dpi_value() / 96.0;
-    int button_diameter_physical = ceil(scaling_factor * BUTTON_DIAMETER);
-    int clock_width_physical = ceil(scaling_factor * CLOCK_WIDTH);
-    int clock_height_physical = ceil(scaling_factor * CLOCK_HEIGHT);
-    int margin_physical = ceil(scaling_factor * CLOCK_MARGIN);
-    DEBUG("scaling_factor is %.f, physical diameter is %d px\n",
-          scaling_factor, button_diameter_physical);
-
-    if (!vistype)
-        vistype = get_root_visual_type(screen);
-
-    /* Initialize cairo: Create one in-memory surface to render the unlock
-     * indicator on, create one XCB surface to actually draw (one or more,
-     * depending on the amount of screens) unlock indicators on. */
+static cairo_surface_t *render_indicator(double scaling_factor, int button_diameter_physical) {
     cairo_surface_t *output = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, button_diameter_physical, button_diameter_physical);
     cairo_t *ctx = cairo_create(output);
 
-    cairo_surface_t *clock_output = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, clock_width_physical, clock_height_physical);
-    cairo_t *clk_ctx = cairo_create(clock_output);
-
-    cairo_surface_t *xcb_output = cairo_xcb_surface_create(conn, bg_pixmap, vistype, resolution[0], resolution[1]);
-    cairo_t *xcb_ctx = cairo_create(xcb_output);
-
-    /* After the first iteration, the pixmap will still contain the previous
-     * contents. Explicitly clear the entire pixmap with the background color
-     * first to get back into a defined state: */
-    char strgroups[3][3] = {{color[0], color[1], '\0'},
-                            {color[2], color[3], '\0'},
-                            {color[4], color[5], '\0'}};
-    uint32_t rgb16[3] = {(strtol(strgroups[0], NULL, 16)),
-                         (strtol(strgroups[1], NULL, 16)),
-                         (strtol(strgroups[2], NULL, 16))};
-    cairo_set_source_rgb(xcb_ctx, rgb16[0] / 255.0, rgb16[1] / 255.0, rgb16[2] / 255.0);
-    cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
-    cairo_fill(xcb_ctx);
-
-    if (img) {
-        if (!tile) {
-            cairo_set_source_surface(xcb_ctx, img, 0, 0);
-            cairo_paint(xcb_ctx);
-        } else {
-            /* create a pattern and fill a rectangle as big as the screen */
-            cairo_pattern_t *pattern;
-            pattern = cairo_pattern_create_for_surface(img);
-            cairo_set_source(xcb_ctx, pattern);
-            cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
-            cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
-            cairo_fill(xcb_ctx);
-            cairo_pattern_destroy(pattern);
-        }
-    }
-
     if (unlock_indicator &&
         (unlock_state >= STATE_KEY_PRESSED || auth_state > STATE_AUTH_IDLE)) {
         cairo_scale(ctx, scaling_factor, scaling_factor);
@@ -195,6 +157,9 @@ void draw_image(xcb_pixmap_t bg_pixmap, uint32_t *resolution) {
             case STATE_I3LOCK_LOCK_FAILED:
                 cairo_set_source_rgb(ctx, NORD(11));
                 break;
+            case STATE_AUTH_TIMEOUT:
+                cairo_set_source_rgb(ctx, NORD(13));
+                break;
             case STATE_AUTH_IDLE:
                 if (unlock_state == STATE_NOTHING_TO_DELETE) {
                     cairo_set_source_rgb(ctx, NORD(12));
@@ -230,6 +195,9 @@ void draw_image(xcb_pixmap_t bg_pixmap, uint32_t *resolution) {
             case STATE_AUTH_LOCK:
                 cairo_set_source_rgb(ctx, NORD(9));
                 break;
+            case STATE_AUTH_TIMEOUT:
+                cairo_set_source_rgb(ctx, NORD(13));
+                break;
             case STATE_AUTH_WRONG:
             case STATE_I3LOCK_LOCK_FAILED:
                 cairo_set_source_rgb(ctx, NORD(11));
@@ -254,6 +222,9 @@ void draw_image(xcb_pixmap_t bg_pixmap, uint32_t *resolution) {
             case STATE_I3LOCK_LOCK_FAILED:
                 text = "Lock failed!";
                 break;
+            case STATE_AUTH_TIMEOUT:
+                text = "Timed out!";
+                break;
             default:
                 if (unlock_state == STATE_NOTHING_TO_DELETE) {
                     text = "No input";
@@ -341,17 +312,29 @@ void draw_image(xcb_pixmap_t bg_pixmap, uint32_t *resolution) {
         }
     }
 
+    cairo_destroy(ctx);
+    return output;
+}
+
+/*
+ * Renders the clock onto a new in-memory surface.
+ *
+ */
+static cairo_surface_t *render_clock(double scaling_factor, int clock_width_physical, int clock_height_physical) {
+    cairo_surface_t *output = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, clock_width_physical, clock_height_physical);
+    cairo_t *ctx = cairo_create(output);
+
     if (clock_visible) {
-        cairo_scale(clk_ctx, scaling_factor, scaling_factor);
+        cairo_scale(ctx, scaling_factor, scaling_factor);
 
         /* Draw the background for the clock */
-        cairo_rectangle(clk_ctx, 1.0, 1.0, CLOCK_WIDTH - 2.0, CLOCK_HEIGHT - 2.0);
-        cairo_set_source_rgb(clk_ctx, NORD(0));
-        cairo_fill_preserve(clk_ctx);
+        cairo_rectangle(ctx, 1.0, 1.0, CLOCK_WIDTH - 2.0, CLOCK_HEIGHT - 2.0);
+        cairo_set_source_rgb(ctx, NORD(0));
+        cairo_fill_preserve(ctx);
 
-        cairo_set_line_width(clk_ctx, 2.0);
-        cairo_set_source_rgb(clk_ctx, NORD(2));
-        cairo_stroke(clk_ctx);
+        cairo_set_line_width(ctx, 2.0);
+        cairo_set_source_rgb(ctx, NORD(2));
+        cairo_stroke(ctx);
 
         time_t t = time(NULL);
         struct tm *now = localtime(&t);
@@ -361,38 +344,109 @@ void draw_image(xcb_pixmap_t bg_pixmap, uint32_t *resolution) {
         strftime(time_text, 8, "%H:%M", now);
         strftime(date_text, 32, "%a, %B %d", now);
 
-        cairo_set_source_rgb(clk_ctx, NORD(4));
-        cairo_select_font_face(clk_ctx, "Fira Mono", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-        cairo_set_font_size(clk_ctx, 48.0);
+        cairo_set_source_rgb(ctx, NORD(4));
+        cairo_select_font_face(ctx, "Fira Mono", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+        cairo_set_font_size(ctx, 48.0);
 
         cairo_text_extents_t extents;
-        cairo_text_extents(clk_ctx, time_text, &extents);
+        cairo_text_extents(ctx, time_text, &extents);
 
         double x = CLOCK_WIDTH / 2.0 - (extents.width / 2 + extents.x_bearing);
         double y = 12.0 + extents.height;
 
-        cairo_move_to(clk_ctx, x, y);
-        cairo_show_text(clk_ctx, time_text);
-        cairo_close_path(clk_ctx);
+        cairo_move_to(ctx, x, y);
+        cairo_show_text(ctx, time_text);
+        cairo_close_path(ctx);
 
-        cairo_set_line_width(clk_ctx, 2.0);
-        cairo_set_source_rgb(clk_ctx, NORD(7));
-        cairo_move_to(clk_ctx, x - 4.0, y + 4.0);
-        cairo_rel_line_to(clk_ctx, extents.width + 8.0, 0.0);
+        cairo_set_line_width(ctx, 2.0);
+        cairo_set_source_rgb(ctx, NORD(7));
+        cairo_move_to(ctx, x - 4.0, y + 4.0);
+        cairo_rel_line_to(ctx, extents.width + 8.0, 0.0);
 
-        cairo_stroke(clk_ctx);
+        cairo_stroke(ctx);
 
-        cairo_set_source_rgb(clk_ctx, NORD(4));
-        cairo_set_font_size(clk_ctx, 16.0);
+        cairo_set_source_rgb(ctx, NORD(4));
+        cairo_set_font_size(ctx, 16.0);
 
         cairo_text_extents_t extents2;
-        cairo_text_extents(clk_ctx, date_text, &extents2);
+        cairo_text_extents(ctx, date_text, &extents2);
 
         double x2 = CLOCK_WIDTH / 2.0 - (extents2.width / 2 + extents2.x_bearing);
         double y2 = CLOCK_HEIGHT - 12.0;
 
-        cairo_move_to(clk_ctx, x2, y2);
-        cairo_show_text(clk_ctx, date_text);
+        cairo_move_to(ctx, x2, y2);
+        cairo_show_text(ctx, date_text);
+    }
+
+    cairo_destroy(ctx);
+    return output;
+}
+
+static void drop_rendered(void) {
+    cairo_surface_destroy(rendered.indicator);
+    cairo_surface_destroy(rendered.clock);
+    rendered.indicator = NULL;
+    rendered.clock = NULL;
+}
+
+/*
+ * Draws global image with fill color onto a pixmap with the given
+ * resolution and returns it.
+ *
+ */
+void draw_image(xcb_pixmap_t bg_pixmap, uint32_t *resolution) {
+    const double scaling_factor = get_dpi_value() / 96.0;
+    int button_diameter_physical = ceil(scaling_factor * BUTTON_DIAMETER);
+    int clock_width_physical = ceil(scaling_factor * CLOCK_WIDTH);
+    int clock_height_physical = ceil(scaling_factor * CLOCK_HEIGHT);
+    int margin_physical = ceil(scaling_factor * CLOCK_MARGIN);
+    DEBUG("scaling_factor is %.f, physical diameter is %d px\n",
+          scaling_factor, button_diameter_physical);
+
+    if (!vistype)
+        vistype = get_root_visual_type(screen);
+
+    /* Initialize cairo: Render the unlock indicator and the clock on
+     * in-memory surfaces (unless this frame already did for another screen),
+     * create one XCB surface to actually draw (one or more, depending on the
+     * amount of screens) unlock indicators on. */
+    if (rendered.indicator == NULL || rendered.scaling_factor != scaling_factor) {
+        drop_rendered();
+        rendered.scaling_factor = scaling_factor;
+        rendered.indicator = render_indicator(scaling_factor, button_diameter_physical);
+        rendered.clock = render_clock(scaling_factor, clock_width_physical, clock_height_physical);
+    }
+
+    cairo_surface_t *xcb_output = cairo_xcb_surface_create(conn, bg_pixmap, vistype, resolution[0], resolution[1]);
+    cairo_t *xcb_ctx = cairo_create(xcb_output);
+
+    /* After the first iteration, the pixmap will still contain the previous
+     * contents. Explicitly clear the entire pixmap with the background color
+     * first to get back into a defined state: */
+    char strgroups[3][3] = {{color[0], color[1], '\0'},
+                            {color[2], color[3], '\0'},
+                            {color[4], color[5], '\0'}};
+    uint32_t rgb16[3] = {(strtol(strgroups[0], NULL, 16)),
+                         (strtol(strgroups[1], NULL, 16)),
+                         (strtol(strgroups[2], NULL, 16))};
+    cairo_set_source_rgb(xcb_ctx, rgb16[0] / 255.0, rgb16[1] / 255.0, rgb16[2] / 255.0);
+    cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
+    cairo_fill(xcb_ctx);
+
+    if (img) {
+        if (!tile) {
+            cairo_set_source_surface(xcb_ctx, img, 0, 0);
+            cairo_paint(xcb_ctx);
+        } else {
+            /* create a pattern and fill a rectangle as big as the screen */
+            cairo_pattern_t *pattern;
+            pattern = cairo_pattern_create_for_surface(img);
+            cairo_set_source(xcb_ctx, pattern);
+            cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
+            cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
+            cairo_fill(xcb_ctx);
+            cairo_pattern_destroy(pattern);
+        }
     }
 
     if (xr_screens > 0) {
@@ -400,14 +454,14 @@ void draw_image(xcb_pixmap_t bg_pixmap, uint32_t *resolution) {
         for (int screen = 0; screen < xr_screens; screen++) {
             int x = (xr_resolutions[screen].x + ((xr_resolutions[screen].width / 2) - (button_diameter_physical / 2)));
             int y = (xr_resolutions[screen].y + ((xr_resolutions[screen].height / 2) - (button_diameter_physical / 2)));
-            cairo_set_source_surface(xcb_ctx, output, x, y);
+            cairo_set_source_surface(xcb_ctx, rendered.indicator, x, y);
             cairo_rectangle(xcb_ctx, x, y, button_diameter_physical, button_diameter_physical);
             cairo_fill(xcb_ctx);
 
             int x2 = xr_resolutions[screen].x + xr_resolutions[screen].width - clock_width_physical - margin_physical;
             int y2 = xr_resolutions[screen].y + xr_resolutions[screen].height - clock_height_physical - margin_physical;
 
-            cairo_set_source_surface(xcb_ctx, clock_output, x2, y2);
+            cairo_set_source_surface(xcb_ctx, rendered.clock, x2, y2);
             cairo_rectangle(xcb_ctx, x2, y2, clock_width_physical, clock_height_physical);
             cairo_fill(xcb_ctx);
         }
@@ -417,27 +471,26 @@ void draw_image(xcb_pixmap_t bg_pixmap, uint32_t *resolution) {
          * hope for the best. */
         int x = (last_resolution[0] / 2) - (button_diameter_physical / 2);
         int y = (last_resolution[1] / 2) - (button_diameter_physical / 2);
-        cairo_set_source_surface(xcb_ctx, output, x, y);
+        cairo_set_source_surface(xcb_ctx, rendered.indicator, x, y);
         cairo_rectangle(xcb_ctx, x, y, button_diameter_physical, button_diameter_physical);
         cairo_fill(xcb_ctx);
 
         int x2 = last_resolution[0] - clock_width_physical - margin_physical;
         int y2 = last_resolution[1] - clock_height_physical - margin_physical;
 
-        cairo_set_source_surface(xcb_ctx, clock_output, x2, y2);
+        cairo_set_source_surface(xcb_ctx, rendered.clock, x2, y2);
         cairo_rectangle(xcb_ctx, x2, y2, clock_width_physical, clock_height_physical);
         cairo_fill(xcb_ctx);
     }
 
     cairo_surface_destroy(xcb_output);
-    cairo_surface_destroy(output);
-    cairo_surface_destroy(clock_output);
-    cairo_destroy(ctx);
     cairo_destroy(xcb_ctx);
-    cairo_destroy(clk_ctx);
+
+    if (!rendered.shared)
+        drop_rendered();
 }
 
-static xcb_pixmap_t bg_pixmap = XCB_NONE;
+xcb_pixmap_t bg_pixmap = XCB_NONE;
 
 /*
  * Releases the current background pixmap so that the next redraw_screen() call
@@ -453,7 +506,12 @@ void free_bg_pixmap(void) {
  * Calls draw_image on a new pixmap and swaps that with the current pixmap
  *
  */
-void redraw_screen(void) {
+static void redraw_display(lock_display_t *d) {
+    if (d->display_off) {
+        d->skipped_redraws++;
+        return;
+    }
+
     DEBUG("redraw_screen(unlock_state = %d, auth_state = %d)\n", unlock_state, auth_state);
     if (bg_pixmap == XCB_NONE) {
         DEBUG("allocating pixmap for %d x %d px\n", last_resolution[0], last_resolution[1]);
@@ -468,6 +526,27 @@ void redraw_screen(void) {
     xcb_flush(conn);
 }
 
+/*
+ * Redraws every display (and every screen of it) which already has its lock
+ * window.
+ *
+ */
+void redraw_screen(void) {
+    lock_display_t *prev = current_display;
+
+    rendered.shared = true;
+    for (int i = 0; i < num_displays; i++) {
+        if (displays[i].broken)
+            continue;
+        display_select(&displays[i]);
+        if (win != XCB_NONE)
+            redraw_display(&displays[i]);
+    }
+    display_select(prev);
+    rendered.shared = false;
+    drop_rendered();
+}
+
 /*
  * Hides the unlock indicator completely when there is no content in the
  * password buffer.
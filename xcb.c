@@ -19,27 +19,40 @@
 #include <assert.h>
 #include <err.h>
 #include <time.h>
-#include <sys/time.h>
+#include <poll.h>
 
+#include "i3lock.h"
 #include "cursors.h"
 #include "unlock_indicator.h"
+#include "display.h"
 
+extern bool debug_mode;
 extern auth_state_t auth_state;
 
 xcb_connection_t *conn;
 xcb_screen_t *screen;
 
-static xcb_atom_t _NET_WM_BYPASS_COMPOSITOR = XCB_NONE;
+/* The number of times i3lock waited for a reply from the X server while
+ * starting up, printed with --debug. */
+int round_trips = 0;
+
+/* Requests sent by prefetch_atoms(), 0 if none is outstanding. */
+static xcb_intern_atom_cookie_t bypass_compositor_cookie;
+static xcb_intern_atom_cookie_t active_window_cookie;
+
+xcb_atom_t _NET_WM_BYPASS_COMPOSITOR = XCB_NONE;
 void _init_net_wm_bypass_compositor(xcb_connection_t *conn) {
     if (_NET_WM_BYPASS_COMPOSITOR != XCB_NONE) {
         /* already initialized */
         return;
     }
+    if (bypass_compositor_cookie.sequence == 0) {
+        bypass_compositor_cookie = xcb_intern_atom(conn, 0, strlen("_NET_WM_BYPASS_COMPOSITOR"), "_NET_WM_BYPASS_COMPOSITOR");
+        round_trips++;
+    }
     xcb_generic_error_t *err;
-    xcb_intern_atom_reply_t *atom_reply = xcb_intern_atom_reply(
-        conn,
-        xcb_intern_atom(conn, 0, strlen("_NET_WM_BYPASS_COMPOSITOR"), "_NET_WM_BYPASS_COMPOSITOR"),
-        &err);
+    xcb_intern_atom_reply_t *atom_reply = xcb_intern_atom_reply(conn, bypass_compositor_cookie, &err);
+    bypass_compositor_cookie.sequence = 0;
     if (atom_reply == NULL) {
         fprintf(stderr, "X11 Error %d\n", err->error_code);
         free(err);
@@ -123,7 +136,11 @@ xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32
     return bg_pixmap;
 }
 
-xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap) {
+/*
+ * Creates the lock window, without mapping it yet (see map_fullscreen_window()).
+ *
+ */
+xcb_window_t create_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap) {
     uint32_t mask = 0;
     uint32_t values[3];
     xcb_window_t win = xcb_generate_id(conn);
@@ -139,10 +156,12 @@ xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, c
     mask |= XCB_CW_OVERRIDE_REDIRECT;
     values[1] = 1;
 
+    /* Only select what xcb_check_cb() handles: Every other event costs a
+     * wakeup. Key releases are not needed, the modifier state comes from XKB
+     * state notify events, and the background pixmap is repainted by the X
+     * server itself on exposure. */
     mask |= XCB_CW_EVENT_MASK;
-    values[2] = XCB_EVENT_MASK_EXPOSURE |
-                XCB_EVENT_MASK_KEY_PRESS |
-                XCB_EVENT_MASK_KEY_RELEASE |
+    values[2] = XCB_EVENT_MASK_KEY_PRESS |
                 XCB_EVENT_MASK_VISIBILITY_CHANGE |
                 XCB_EVENT_MASK_STRUCTURE_NOTIFY;
 
@@ -189,121 +208,151 @@ xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, c
                         1,
                         &bypass_compositor);
 
+    return win;
+}
+
+void map_fullscreen_window(xcb_connection_t *conn, xcb_window_t win) {
     /* Map the window (= make it visible) */
     xcb_map_window(conn, win);
 
     /* Raise window (put it on top) */
-    values[0] = XCB_STACK_MODE_ABOVE;
-    xcb_configure_window(conn, win, XCB_CONFIG_WINDOW_STACK_MODE, values);
+    xcb_configure_window(conn, win, XCB_CONFIG_WINDOW_STACK_MODE, (uint32_t[]){XCB_STACK_MODE_ABOVE});
 
-    /* Ensure that the window is created and set up before returning */
-    xcb_aux_sync(conn);
+    /* No xcb_aux_sync() here: The X server handles requests in order, so the
+     * grab (which waits for its reply) happens on the mapped window anyway. */
+    xcb_flush(conn);
+}
 
+xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap) {
+    xcb_window_t win = create_fullscreen_window(conn, scr, color, pixmap);
+    map_fullscreen_window(conn, win);
     return win;
 }
 
+/* The delay between grab attempts starts at GRAB_MIN_DELAY and doubles after
+ * every failed attempt, up to GRAB_MAX_DELAY (all in milliseconds). */
+#define GRAB_MIN_DELAY 1
+#define GRAB_MAX_DELAY 32
+
+/* Show the “locking…” message when grabbing takes longer than this. */
+#define GRAB_REDRAW_TIMEOUT 100
+
+static double monotonic_msec(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+        err(EXIT_FAILURE, "clock_gettime");
+    }
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
 /*
- * Repeatedly tries to grab pointer and keyboard (up to the specified number of
- * tries).
+ * Tries to grab pointer and keyboard until timeout (in milliseconds) passed.
+ *
+ * Both grab requests are sent together, so that an attempt costs one round
+ * trip. Between attempts, we wait for the X11 connection with an exponentially
+ * growing timeout: The grab is usually held by a context menu or another
+ * client’s grab, and the menu being unmapped or the focus changing (which we
+ * select on the root window meanwhile) wakes us up to try again right away.
  *
  * Returns true if the grab succeeded, false if not.
  *
  */
-bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor, int tries) {
+bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor, int timeout) {
     xcb_grab_pointer_cookie_t pcookie;
     xcb_grab_pointer_reply_t *preply;
 
     xcb_grab_keyboard_cookie_t kcookie;
     xcb_grab_keyboard_reply_t *kreply;
 
-    const suseconds_t screen_redraw_timeout = 100000; /* 100ms */
-
-    /* Using few variables to trigger a redraw_screen() if too many tries */
+    bool pointer_grabbed = false;
+    bool keyboard_grabbed = false;
     bool redrawn = false;
-    struct timeval start;
-    if (gettimeofday(&start, NULL) == -1) {
-        err(EXIT_FAILURE, "gettimeofday");
-    }
-
-    while (tries-- > 0) {
-        pcookie = xcb_grab_pointer(
-            conn,
-            false,               /* get all pointer events specified by the following mask */
-            screen->root,        /* grab the root window */
-            XCB_NONE,            /* which events to let through */
-            XCB_GRAB_MODE_ASYNC, /* pointer events should continue as normal */
-            XCB_GRAB_MODE_ASYNC, /* keyboard mode */
-            XCB_NONE,            /* confine_to = in which window should the cursor stay */
-            cursor,              /* we change the cursor to whatever the user wanted */
-            XCB_CURRENT_TIME);
-
-        if ((preply = xcb_grab_pointer_reply(conn, pcookie, NULL)) &&
-            preply->status == XCB_GRAB_STATUS_SUCCESS) {
-            free(preply);
-            break;
+    int attempts = 0;
+    int delay = GRAB_MIN_DELAY;
+    const double start = monotonic_msec();
+    const double deadline = start + timeout;
+
+    xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK,
+                                 (uint32_t[]){
+                                     XCB_EVENT_MASK_STRUCTURE_NOTIFY |
+                                     XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY |
+                                     XCB_EVENT_MASK_FOCUS_CHANGE});
+
+    while (true) {
+        attempts++;
+        if (!pointer_grabbed) {
+            pcookie = xcb_grab_pointer(
+                conn,
+                false,               /* get all pointer events specified by the following mask */
+                screen->root,        /* grab the root window */
+                XCB_NONE,            /* which events to let through */
+                XCB_GRAB_MODE_ASYNC, /* pointer events should continue as normal */
+                XCB_GRAB_MODE_ASYNC, /* keyboard mode */
+                XCB_NONE,            /* confine_to = in which window should the cursor stay */
+                cursor,              /* we change the cursor to whatever the user wanted */
+                XCB_CURRENT_TIME);
         }
 
-        /* In case the grab failed, we still need to free the reply */
-        free(preply);
-
-        /* Make this quite a bit slower */
-        usleep(50);
-
-        struct timeval now;
-        if (gettimeofday(&now, NULL) == -1) {
-            err(EXIT_FAILURE, "gettimeofday");
+        if (!keyboard_grabbed) {
+            kcookie = xcb_grab_keyboard(
+                conn,
+                true,         /* report events */
+                screen->root, /* grab the root window */
+                XCB_CURRENT_TIME,
+                XCB_GRAB_MODE_ASYNC, /* process events as normal, do not require sync */
+                XCB_GRAB_MODE_ASYNC);
         }
 
-        struct timeval elapsed;
-        timersub(&now, &start, &elapsed);
-
-        if (!redrawn &&
-            (tries % 100) == 0 &&
-            elapsed.tv_usec >= screen_redraw_timeout) {
-            redraw_screen();
-            redrawn = true;
+        /* In case the grab failed, we still need to free the reply */
+        round_trips++;
+        if (!pointer_grabbed) {
+            preply = xcb_grab_pointer_reply(conn, pcookie, NULL);
+            pointer_grabbed = (preply && preply->status == XCB_GRAB_STATUS_SUCCESS);
+            free(preply);
         }
-    }
 
-    while (tries-- > 0) {
-        kcookie = xcb_grab_keyboard(
-            conn,
-            true,         /* report events */
-            screen->root, /* grab the root window */
-            XCB_CURRENT_TIME,
-            XCB_GRAB_MODE_ASYNC, /* process events as normal, do not require sync */
-            XCB_GRAB_MODE_ASYNC);
-
-        if ((kreply = xcb_grab_keyboard_reply(conn, kcookie, NULL)) &&
-            kreply->status == XCB_GRAB_STATUS_SUCCESS) {
+        if (!keyboard_grabbed) {
+            kreply = xcb_grab_keyboard_reply(conn, kcookie, NULL);
+            keyboard_grabbed = (kreply && kreply->status == XCB_GRAB_STATUS_SUCCESS);
             free(kreply);
-            break;
         }
 
-        /* In case the grab failed, we still need to free the reply */
-        free(kreply);
-
-        /* Make this quite a bit slower */
-        usleep(50);
-
-        struct timeval now;
-        if (gettimeofday(&now, NULL) == -1) {
-            err(EXIT_FAILURE, "gettimeofday");
-        }
+        if (pointer_grabbed && keyboard_grabbed)
+            break;
 
-        struct timeval elapsed;
-        timersub(&now, &start, &elapsed);
+        double now = monotonic_msec();
+        if (now >= deadline)
+            break;
 
         /* Trigger a screen redraw if 100ms elapsed */
-        if (!redrawn &&
-            (tries % 100) == 0 &&
-            elapsed.tv_usec >= screen_redraw_timeout) {
+        if (!redrawn && now - start >= GRAB_REDRAW_TIMEOUT) {
             redraw_screen();
             redrawn = true;
         }
+
+        /* We only care whether something happened at all: The next grab
+         * reply reads the events into the XCB queue, where the main loop
+         * handles them later. */
+        struct pollfd pfd = {
+            .fd = xcb_get_file_descriptor(conn),
+            .events = POLLIN,
+        };
+        int wait = (delay < deadline - now ? delay : (int)(deadline - now) + 1);
+        if (poll(&pfd, 1, wait) > 0) {
+            delay = GRAB_MIN_DELAY;
+        } else if (delay < GRAB_MAX_DELAY) {
+            delay *= 2;
+        }
     }
 
-    return (tries > 0);
+    xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK,
+                                 (uint32_t[]){XCB_EVENT_MASK_STRUCTURE_NOTIFY});
+
+    DEBUG("%s pointer and keyboard after %d attempts, %.1f ms\n",
+          (pointer_grabbed && keyboard_grabbed ? "grabbed" : "could not grab"),
+          attempts, monotonic_msec() - start);
+
+    return (pointer_grabbed && keyboard_grabbed);
 }
 
 xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_window_t win, int choice) {
@@ -369,17 +418,19 @@ xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_win
     return cursor;
 }
 
-static xcb_atom_t _NET_ACTIVE_WINDOW = XCB_NONE;
+xcb_atom_t _NET_ACTIVE_WINDOW = XCB_NONE;
 void _init_net_active_window(xcb_connection_t *conn) {
     if (_NET_ACTIVE_WINDOW != XCB_NONE) {
         /* already initialized */
         return;
     }
+    if (active_window_cookie.sequence == 0) {
+        active_window_cookie = xcb_intern_atom(conn, 0, strlen("_NET_ACTIVE_WINDOW"), "_NET_ACTIVE_WINDOW");
+        round_trips++;
+    }
     xcb_generic_error_t *err;
-    xcb_intern_atom_reply_t *atom_reply = xcb_intern_atom_reply(
-        conn,
-        xcb_intern_atom(conn, 0, strlen("_NET_ACTIVE_WINDOW"), "_NET_ACTIVE_WINDOW"),
-        &err);
+    xcb_intern_atom_reply_t *atom_reply = xcb_intern_atom_reply(conn, active_window_cookie, &err);
+    active_window_cookie.sequence = 0;
     if (atom_reply == NULL) {
         fprintf(stderr, "X11 Error %d\n", err->error_code);
         free(err);
@@ -389,11 +440,29 @@ void _init_net_active_window(xcb_connection_t *conn) {
     free(atom_reply);
 }
 
+/*
+ * Sends the requests for the atoms i3lock needs. The replies are read by
+ * init_atoms(), so that asking for them costs no round trip of its own.
+ *
+ */
+void prefetch_atoms(xcb_connection_t *conn) {
+    if (_NET_WM_BYPASS_COMPOSITOR == XCB_NONE && bypass_compositor_cookie.sequence == 0)
+        bypass_compositor_cookie = xcb_intern_atom(conn, 0, strlen("_NET_WM_BYPASS_COMPOSITOR"), "_NET_WM_BYPASS_COMPOSITOR");
+    if (_NET_ACTIVE_WINDOW == XCB_NONE && active_window_cookie.sequence == 0)
+        active_window_cookie = xcb_intern_atom(conn, 0, strlen("_NET_ACTIVE_WINDOW"), "_NET_ACTIVE_WINDOW");
+}
+
+void init_atoms(xcb_connection_t *conn) {
+    _init_net_wm_bypass_compositor(conn);
+    _init_net_active_window(conn);
+}
+
 xcb_window_t find_focused_window(xcb_connection_t *conn, const xcb_window_t root) {
     xcb_window_t result = XCB_NONE;
 
     _init_net_active_window(conn);
 
+    round_trips++;
     xcb_get_property_reply_t *prop_reply = xcb_get_property_reply(
         conn,
         xcb_get_property_unchecked(